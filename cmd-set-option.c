@@ -251,6 +251,8 @@ cmd_set_option_exec(struct cmd *self, struct cmdq_item *item)
 		status_timer_start_all();
 	if (strcmp(name, "monitor-silence") == 0)
 		alerts_reset_all();
+	if (strcmp(name, "history-memory-limit") == 0)
+		window_history_timer_start();
 	if (strcmp(name, "window-style") == 0 ||
 	    strcmp(name, "window-active-style") == 0) {
 		RB_FOREACH(w, windows, &windows)
@@ -392,6 +392,14 @@ format_cb_pid(__unused struct format_tree *ft, struct format_entry *fe)
 	xasprintf(&fe->value, "%ld", (long)getpid());
 }
 
+/* Callback for history_total_bytes. */
+static void
+format_cb_history_total_bytes(__unused struct format_tree *ft,
+    struct format_entry *fe)
+{
+	xasprintf(&fe->value, "%llu", window_history_total_bytes());
+}
+
 /* Callback for session_alerts. */
 static void
 format_cb_session_alerts(struct format_tree *ft, struct format_entry *fe)
@@ -546,24 +554,42 @@ static void
 format_cb_history_bytes(struct format_tree *ft, struct format_entry *fe)
 {
 	struct window_pane	*wp = ft->wp;
-	struct grid		*gd;
-	struct grid_line	*gl;
-	unsigned long long	 size;
-	u_int			 i;
+	size_t			 raw, compressed;
 
 	if (wp == NULL)
 		return;
-	gd = wp->base.grid;
+	grid_history_bytes(wp->base.grid, &raw, &compressed);
 
-	size = 0;
-	for (i = 0; i < gd->hsize; i++) {
-		gl = &gd->linedata[i];
-		size += gl->cellsize * sizeof *gl->celldata;
-		size += gl->extdsize * sizeof *gl->extddata;
-	}
-	size += gd->hsize * sizeof *gd->linedata;
+	xasprintf(&fe->value, "%llu", (unsigned long long)(raw + compressed));
+}
+
+/* Callback for history_raw_bytes. */
+static void
+format_cb_history_raw_bytes(struct format_tree *ft, struct format_entry *fe)
+{
+	struct window_pane	*wp = ft->wp;
+	size_t			 raw, compressed;
+
+	if (wp == NULL)
+		return;
+	grid_history_bytes(wp->base.grid, &raw, &compressed);
+
+	xasprintf(&fe->value, "%llu", (unsigned long long)raw);
+}
+
+/* Callback for history_compressed_bytes. */
+static void
+format_cb_history_compressed_bytes(struct format_tree *ft,
+    struct format_entry *fe)
+{
+	struct window_pane	*wp = ft->wp;
+	size_t			 raw, compressed;
+
+	if (wp == NULL)
+		return;
+	grid_history_bytes(wp->base.grid, &raw, &compressed);
 
-	xasprintf(&fe->value, "%llu", size);
+	xasprintf(&fe->value, "%llu", (unsigned long long)compressed);
 }
 
 /* Callback for pane_tabs. */
@@ -632,6 +658,8 @@ format_create(struct client *c, struct cmdq_item *item, int tag, int flags)
 	format_add_cb(ft, "pid", format_cb_pid);
 	format_add(ft, "socket_path", "%s", socket_path);
 	format_add_tv(ft, "start_time", &start_time);
+	format_add_cb(ft, "history_total_bytes",
+	    format_cb_history_total_bytes);
 
 	if (item != NULL) {
 		if (item->cmd != NULL)
@@ -1309,6 +1337,9 @@ format_defaults_client(struct format_tree *ft, struct client *c)
 
 	format_add(ft, "client_written", "%zu", c->written);
 	format_add(ft, "client_discarded", "%zu", c->discarded);
+	format_add(ft, "client_discards", "%u", c->discards);
+	format_add(ft, "client_bandwidth", "%zu", tty->bandwidth);
+	format_add(ft, "client_cursor_saved", "%zu", c->cursor_saved);
 
 	name = server_client_get_key_table(c);
 	if (strcmp(c->keytable->name, name) == 0)
@@ -1398,6 +1429,9 @@ format_defaults_pane(struct format_tree *ft, struct window_pane *wp)
 	format_add(ft, "history_size", "%u", gd->hsize);
 	format_add(ft, "history_limit", "%u", gd->hlimit);
 	format_add_cb(ft, "history_bytes", format_cb_history_bytes);
+	format_add_cb(ft, "history_raw_bytes", format_cb_history_raw_bytes);
+	format_add_cb(ft, "history_compressed_bytes",
+	    format_cb_history_compressed_bytes);
 
 	if (window_pane_index(wp, &idx) != 0)
 		fatalx("index not found");
@@ -1433,6 +1467,8 @@ format_defaults_pane(struct format_tree *ft, struct window_pane *wp)
 
 	format_add(ft, "pane_tty", "%s", wp->tty);
 	format_add(ft, "pane_pid", "%ld", (long) wp->pid);
+	format_add(ft, "pane_read_size", "%zu", wp->read_size);
+	format_add(ft, "pane_read_average", "%zu", wp->read_average);
 	format_add_cb(ft, "pane_start_command", format_cb_start_command);
 	format_add_cb(ft, "pane_current_command", format_cb_current_command);
 	format_add_cb(ft, "pane_current_path", format_cb_current_path);
@@ -33,8 +33,158 @@
  * (hsize - 1); from hsize to hsize + (sy - 1) is the viewable data. All
  * functions in this file work on absolute coordinates, grid-view.c has
  * functions which work on the screen data.
+ *
+ * The lines are kept in a ring buffer (linedata) of linesize entries starting
+ * at lineoff, so lines may be added at the bottom and removed from the top of
+ * the history without moving the remaining lines. grid_get_line maps a line
+ * number to its entry in the ring.
+ *
+ * History lines which have scrolled well past the visible area are packed into
+ * compressed blocks of GRID_BLOCK_LINES lines. grid_peek_line uncompresses a
+ * block into a cache for reading, grid_get_line uncompresses the line itself
+ * when it is to be modified.
+ *
+ * Only the first cellstored cells of a line are kept in celldata. Any cells
+ * from there up to cellsize are a run of the same cell, held once as the fill
+ * entry. This is used for cells cleared with a background colour, so a line
+ * cleared to the end does not need a cell entry for every column.
+ *
+ * Cells with a single byte character which need more than the entry can hold
+ * (an RGB colour or attributes above 0xff) refer instead to a style in a table
+ * kept by the grid, so each different style is stored only once. Other cells
+ * which do not fit in the entry are extended cells with a full grid_cell in
+ * the line's extddata.
+ *
+ * The first history line of each logical line (a run of wrapped lines) may be
+ * kept in an index, so the lines making up a logical line can be found without
+ * walking back through the history. The index is built when first needed and
+ * then kept up to date as lines are added to and removed from the history;
+ * anything else which changes the history discards it.
+ *
+ * When a grid is reflowed, only the screen and the history just above it are
+ * reflowed immediately. Older history is moved to a pending grid and reflowed
+ * a piece at a time later, when it is added to the top of the history.
+ *
+ * The cell data for lines, the compressed blocks and the block cache are all
+ * allocated from an arena belonging to the grid. The arena hands out chunks
+ * from slabs, each slab holding chunks of one size class, so a line which
+ * grows usually stays in the same chunk and destroying the grid or clearing
+ * its history frees whole slabs without looking at each line.
  */
 
+/* Lines packed into each compressed block and distance before packing. */
+#define GRID_BLOCK_LINES 128
+#define GRID_COLD_LINES 1000
+
+/* Lines reflowed above the screen immediately and in each later piece. */
+#define GRID_REFLOW_LINES 1000
+
+/* Size of slabs and the sizes of chunks they are split into. */
+#define GRID_SLAB_SIZE 65536
+static const u_int grid_slab_sizes[] = {
+	16, 32, 48, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320, 384, 448,
+	512, 640, 768, 896, 1024, 1280, 1536, 1792, 2048, 2560, 3072, 3584,
+	4096, 5120, 6144, 7168, 8192, 10240, 12288, 14336, 16384
+};
+#define GRID_SLAB_CLASSES nitems(grid_slab_sizes)
+
+/* Header before each chunk, or link in the free list once it is freed. */
+union grid_chunk {
+	struct grid_slab	*slab;
+	union grid_chunk	*next;
+	uint64_t		 align;
+};
+
+/* Slab of chunks. Allocations too big for any class get a slab each. */
+struct grid_slab {
+	struct grid_arena	*arena;
+	u_int			 class;
+	size_t			 chunk;
+
+	u_int			 chunks;
+	u_int			 used;
+	u_int			 next;
+	union grid_chunk	*free;
+
+	u_char			*data;
+
+	TAILQ_ENTRY(grid_slab)	 entry;
+};
+TAILQ_HEAD(grid_slabs, grid_slab);
+
+/*
+ * Arena of slabs. Slabs with free chunks are kept at the head of each list and
+ * full slabs at the tail.
+ */
+struct grid_arena {
+	struct grid_slabs	 slabs[GRID_SLAB_CLASSES];
+	u_int			 nslabs[GRID_SLAB_CLASSES];
+	struct grid_slabs	 large;
+
+	u_int			 references;
+};
+
+/* Largest number of styles before using extended cells instead. */
+#define GRID_STYLE_MAX 65536
+
+/* Style shared by styled cells. */
+struct grid_style {
+	u_int			 id;
+
+	u_char			 flags;
+	u_short			 attr;
+	int			 fg;
+	int			 bg;
+
+	RB_ENTRY(grid_style)	 entry;
+};
+RB_HEAD(grid_style_tree, grid_style);
+
+/* Table of styles for a grid. */
+struct grid_styles {
+	struct grid_style	**list;
+	u_int			  size;
+
+	struct grid_style_tree	  tree;
+
+	u_int			  references;
+};
+
+/*
+ * First history line of each logical line. Entries are offsets from base, which
+ * is advanced when lines are removed from the top of the history.
+ */
+struct grid_index {
+	u_int	*list;
+	u_int	 first;
+	u_int	 used;
+	u_int	 size;
+
+	u_int	 base;
+};
+
+/* Compressed block of lines. */
+struct grid_block {
+	u_char			*data;
+	size_t			 size;
+	size_t			 rawsize;
+
+	u_int			 lines;
+	u_int			 references;
+
+	struct grid_line	*decoded;
+};
+
+/* Header stored before each line in a block. */
+struct grid_block_header {
+	u_int			 cellused;
+	u_int			 cellsize;
+	u_int			 cellstored;
+	u_int			 extdsize;
+	int			 flags;
+	struct grid_cell_entry	 fill;
+};
+
 /* Default grid cell data. */
 const struct grid_cell grid_default_cell = {
 	0, 0, 8, 8, { { ' ' }, 0, 1, 1 }
@@ -43,22 +193,358 @@ static const struct grid_cell_entry grid_default_entry = {
 	0, { .data = { 0, 8, 8, ' ' } }
 };
 
+static struct grid_arena *grid_arena_create(void);
+static void	grid_arena_destroy(struct grid_arena *);
+static void	*grid_alloc(struct grid *, size_t);
+static void	*grid_realloc(struct grid *, void *, size_t, size_t);
+static void	grid_free(void *);
+
+static int	grid_style_cmp(struct grid_style *, struct grid_style *);
+RB_GENERATE_STATIC(grid_style_tree, grid_style, entry, grid_style_cmp);
+
+static struct grid_styles *grid_styles_create(void);
+static void	grid_styles_free(struct grid_styles *);
+static int	grid_style_add(struct grid_styles *, const struct grid_cell *,
+		    u_int *);
+static void	grid_style_get(struct grid_styles *, u_int, struct grid_cell *);
+static void	grid_reset_styles(struct grid *);
+static void	grid_restyle_line(struct grid *, u_int, struct grid_line *,
+		    struct grid_styles *);
+
+static struct grid_line *grid_ring_line(struct grid *, u_int);
+static void	grid_set_line_size(struct grid *, u_int, u_int);
+static void	grid_grow_lines(struct grid *, u_int);
+static void	grid_copy_lines(struct grid *, u_int, u_int, u_int);
+static void	grid_free_lines(struct grid *, u_int, u_int);
+static void	grid_count_line(struct grid *, const struct grid_line *, int);
 static void	grid_expand_line(struct grid *, u_int, u_int, u_int);
+static void	grid_fill_line(struct grid *, u_int, u_int, u_int, u_int);
 static void	grid_empty_line(struct grid *, u_int, u_int);
 
-static void	grid_reflow_copy(struct grid_line *, u_int, struct grid_line *,
-		    u_int, u_int);
+static void	grid_index_free(struct grid *);
+static void	grid_index_build(struct grid *);
+static void	grid_index_add(struct grid *, u_int);
+static void	grid_index_trim(struct grid *, u_int);
+static u_int	grid_index_find(struct grid_index *, u_int);
+
+static u_char	*grid_block_compress(const u_char *, size_t, size_t *);
+static void	 grid_block_uncompress(const u_char *, size_t, u_char *,
+		     size_t);
+static void	 grid_block_cache(struct grid *, struct grid_block *);
+static void	 grid_block_uncache(struct grid *);
+static void	 grid_block_release(struct grid *, struct grid_block *);
+static void	 grid_compress_lines(struct grid *, u_int, u_int);
+static void	 grid_compress_history(struct grid *);
+
+static void	grid_reflow_copy(struct grid *, struct grid_line *, u_int,
+		    struct grid_line *, u_int, u_int);
 static void	grid_reflow_join(struct grid *, u_int *, struct grid_line *,
 		    u_int);
 static void	grid_reflow_split(struct grid *, u_int *, struct grid_line *,
 		    u_int, u_int);
 static void	grid_reflow_move(struct grid *, u_int *, struct grid_line *);
+static void	grid_reflow_lines(struct grid *, u_int *, struct grid *, u_int,
+		    u_int, u_int);
+static u_int	grid_reflow_start(struct grid *, u_int, u_int);
+static void	grid_reflow_defer(struct grid *, struct grid *, u_int);
+static void	grid_prepend_lines(struct grid *, struct grid *, u_int);
+static void	grid_free_pending(struct grid *);
 
 static size_t	grid_string_cells_fg(const struct grid_cell *, int *);
 static size_t	grid_string_cells_bg(const struct grid_cell *, int *);
 static void	grid_string_cells_code(const struct grid_cell *,
 		    const struct grid_cell *, char *, size_t, int);
 
+/* Create an empty arena. */
+static struct grid_arena *
+grid_arena_create(void)
+{
+	struct grid_arena	*ga;
+	u_int			 i;
+
+	ga = xcalloc(1, sizeof *ga);
+	for (i = 0; i < GRID_SLAB_CLASSES; i++)
+		TAILQ_INIT(&ga->slabs[i]);
+	TAILQ_INIT(&ga->large);
+	ga->references = 1;
+	return (ga);
+}
+
+/*
+ * Drop a reference to an arena, destroying it and everything allocated from it
+ * if it was the last.
+ */
+static void
+grid_arena_destroy(struct grid_arena *ga)
+{
+	struct grid_slab	*gs;
+	u_int			 i;
+
+	if (--ga->references != 0)
+		return;
+
+	for (i = 0; i < GRID_SLAB_CLASSES; i++) {
+		while ((gs = TAILQ_FIRST(&ga->slabs[i])) != NULL) {
+			TAILQ_REMOVE(&ga->slabs[i], gs, entry);
+			free(gs->data);
+			free(gs);
+		}
+	}
+	while ((gs = TAILQ_FIRST(&ga->large)) != NULL) {
+		TAILQ_REMOVE(&ga->large, gs, entry);
+		free(gs->data);
+		free(gs);
+	}
+	free(ga);
+}
+
+/*
+ * Allocate a chunk from the grid's arena. A new slab starts with a few chunks
+ * and each further slab in the same class doubles that up to GRID_SLAB_SIZE,
+ * so small grids do not hold on to much unused memory.
+ */
+static void *
+grid_alloc(struct grid *gd, size_t size)
+{
+	struct grid_arena	*ga = gd->arena;
+	struct grid_slab	*gs;
+	union grid_chunk	*gc;
+	size_t			 need;
+	u_int			 lo, hi, class, chunks;
+
+	need = size + sizeof *gc;
+	if (need < size)
+		fatalx("grid_alloc: size overflow");
+
+	lo = 0;
+	hi = GRID_SLAB_CLASSES;
+	while (lo < hi) {
+		class = (lo + hi) / 2;
+		if (grid_slab_sizes[class] < need)
+			lo = class + 1;
+		else
+			hi = class;
+	}
+	class = lo;
+
+	if (class == GRID_SLAB_CLASSES) {
+		gs = xcalloc(1, sizeof *gs);
+		gs->arena = ga;
+		gs->class = class;
+		gs->chunk = need;
+		gs->chunks = gs->used = gs->next = 1;
+		gs->data = xmalloc(need);
+		TAILQ_INSERT_HEAD(&ga->large, gs, entry);
+
+		gc = (union grid_chunk *)gs->data;
+		gc->slab = gs;
+		return (gc + 1);
+	}
+
+	gs = TAILQ_FIRST(&ga->slabs[class]);
+	if (gs == NULL || gs->used == gs->chunks) {
+		chunks = GRID_SLAB_SIZE / grid_slab_sizes[class];
+		if (ga->nslabs[class] < 8 && (4U << ga->nslabs[class]) < chunks)
+			chunks = 4U << ga->nslabs[class];
+
+		gs = xcalloc(1, sizeof *gs);
+		gs->arena = ga;
+		gs->class = class;
+		gs->chunk = grid_slab_sizes[class];
+		gs->chunks = chunks;
+		gs->data = xreallocarray(NULL, chunks, gs->chunk);
+		TAILQ_INSERT_HEAD(&ga->slabs[class], gs, entry);
+		ga->nslabs[class]++;
+	}
+
+	if (gs->free != NULL) {
+		gc = gs->free;
+		gs->free = gc->next;
+	} else
+		gc = (union grid_chunk *)(gs->data + gs->next++ * gs->chunk);
+	gc->slab = gs;
+
+	if (++gs->used == gs->chunks) {
+		TAILQ_REMOVE(&ga->slabs[class], gs, entry);
+		TAILQ_INSERT_TAIL(&ga->slabs[class], gs, entry);
+	}
+	return (gc + 1);
+}
+
+/* Grow a chunk, keeping it if it is already big enough. */
+static void *
+grid_realloc(struct grid *gd, void *ptr, size_t nmemb, size_t size)
+{
+	union grid_chunk	*gc;
+	void			*new;
+	size_t			 have;
+
+	if (nmemb != 0 && SIZE_MAX / nmemb < size)
+		fatalx("grid_realloc: size overflow");
+	size *= nmemb;
+
+	if (ptr == NULL)
+		return (grid_alloc(gd, size));
+	gc = (union grid_chunk *)ptr - 1;
+	have = gc->slab->chunk - sizeof *gc;
+	if (size <= have)
+		return (ptr);
+
+	new = grid_alloc(gd, size);
+	memcpy(new, ptr, have);
+	grid_free(ptr);
+	return (new);
+}
+
+/* Return a chunk to its slab, freeing the slab if it is empty and not alone. */
+static void
+grid_free(void *ptr)
+{
+	union grid_chunk	*gc;
+	struct grid_slab	*gs;
+	struct grid_arena	*ga;
+	struct grid_slabs	*slabs;
+
+	if (ptr == NULL)
+		return;
+	gc = (union grid_chunk *)ptr - 1;
+	gs = gc->slab;
+	ga = gs->arena;
+
+	if (gs->class == GRID_SLAB_CLASSES) {
+		TAILQ_REMOVE(&ga->large, gs, entry);
+		free(gs->data);
+		free(gs);
+		return;
+	}
+	slabs = &ga->slabs[gs->class];
+
+	if (gs->used-- == gs->chunks) {
+		TAILQ_REMOVE(slabs, gs, entry);
+		TAILQ_INSERT_HEAD(slabs, gs, entry);
+	}
+	if (gs->used == 0 &&
+	    (TAILQ_FIRST(slabs) != gs || TAILQ_NEXT(gs, entry) != NULL)) {
+		TAILQ_REMOVE(slabs, gs, entry);
+		ga->nslabs[gs->class]--;
+		free(gs->data);
+		free(gs);
+		return;
+	}
+	gc->next = gs->free;
+	gs->free = gc;
+}
+
+/* Compare styles. */
+static int
+grid_style_cmp(struct grid_style *gs1, struct grid_style *gs2)
+{
+	if (gs1->flags != gs2->flags)
+		return (gs1->flags < gs2->flags ? -1 : 1);
+	if (gs1->attr != gs2->attr)
+		return (gs1->attr < gs2->attr ? -1 : 1);
+	if (gs1->fg != gs2->fg)
+		return (gs1->fg < gs2->fg ? -1 : 1);
+	if (gs1->bg != gs2->bg)
+		return (gs1->bg < gs2->bg ? -1 : 1);
+	return (0);
+}
+
+/* Create an empty style table. */
+static struct grid_styles *
+grid_styles_create(void)
+{
+	struct grid_styles	*gss;
+
+	gss = xcalloc(1, sizeof *gss);
+	RB_INIT(&gss->tree);
+	gss->references = 1;
+	return (gss);
+}
+
+/* Drop a reference to a style table, freeing it if it was the last. */
+static void
+grid_styles_free(struct grid_styles *gss)
+{
+	u_int	i;
+
+	if (--gss->references != 0)
+		return;
+
+	for (i = 0; i < gss->size; i++)
+		free(gss->list[i]);
+	free(gss->list);
+	free(gss);
+}
+
+/* Find the style of a cell, adding it if it is not already in the table. */
+static int
+grid_style_add(struct grid_styles *gss, const struct grid_cell *gc, u_int *id)
+{
+	struct grid_style	 find, *gs;
+
+	find.flags = gc->flags;
+	find.attr = gc->attr;
+	find.fg = gc->fg;
+	find.bg = gc->bg;
+	if ((gs = RB_FIND(grid_style_tree, &gss->tree, &find)) != NULL) {
+		*id = gs->id;
+		return (0);
+	}
+	if (gss->size == GRID_STYLE_MAX)
+		return (-1);
+
+	gs = xmalloc(sizeof *gs);
+	memcpy(gs, &find, sizeof *gs);
+	gs->id = gss->size;
+	RB_INSERT(grid_style_tree, &gss->tree, gs);
+
+	if ((gss->size & (gss->size - 1)) == 0) {
+		gss->list = xreallocarray(gss->list,
+		    gss->size == 0 ? 1 : gss->size * 2, sizeof *gss->list);
+	}
+	gss->list[gss->size++] = gs;
+
+	*id = gs->id;
+	return (0);
+}
+
+/* Copy a style into a cell. */
+static void
+grid_style_get(struct grid_styles *gss, u_int id, struct grid_cell *gc)
+{
+	struct grid_style	*gs;
+
+	if (id >= gss->size)
+		fatalx("bad style %u", id);
+	gs = gss->list[id];
+
+	gc->flags = gs->flags;
+	gc->attr = gs->attr;
+	gc->fg = gs->fg;
+	gc->bg = gs->bg;
+}
+
+/*
+ * Replace the style table with one holding only the styles used by the visible
+ * lines. The history must be empty.
+ */
+static void
+grid_reset_styles(struct grid *gd)
+{
+	struct grid_styles	*gss = gd->styles;
+	struct grid_line	*gl;
+	u_int			 yy;
+
+	gd->styles = grid_styles_create();
+	for (yy = gd->hsize; yy < gd->hsize + gd->sy; yy++) {
+		gl = grid_get_line(gd, yy);
+		if (gl->flags & GRID_LINE_EXTENDED)
+			grid_restyle_line(gd, yy, gl, gss);
+	}
+	grid_styles_free(gss);
+}
+
 /* Store cell in entry. */
 static void
 grid_store_cell(struct grid_cell_entry *gce, const struct grid_cell *gc,
@@ -96,18 +582,20 @@ grid_need_extended_cell(const struct grid_cell_entry *gce,
 
 /* Set cell as extended. */
 static struct grid_cell *
-grid_extended_cell(struct grid_line *gl, struct grid_cell_entry *gce,
-    const struct grid_cell *gc)
+grid_extended_cell(struct grid *gd, u_int py, struct grid_line *gl,
+    struct grid_cell_entry *gce, const struct grid_cell *gc)
 {
 	struct grid_cell	*gcp;
 
 	gl->flags |= GRID_LINE_EXTENDED;
 
 	if (~gce->flags & GRID_FLAG_EXTENDED) {
-		gl->extddata = xreallocarray(gl->extddata, gl->extdsize + 1,
-		    sizeof *gl->extddata);
+		gl->extddata = grid_realloc(gd, gl->extddata,
+		    gl->extdsize + 1, sizeof *gl->extddata);
 		gce->offset = gl->extdsize++;
 		gce->flags = gc->flags | GRID_FLAG_EXTENDED;
+		if (py < gd->hsize)
+			gd->hextdbytes += sizeof *gl->extddata;
 	}
 	if (gce->offset >= gl->extdsize)
 		fatalx("offset too big");
@@ -117,18 +605,41 @@ grid_extended_cell(struct grid_line *gl, struct grid_cell_entry *gce,
 	return (gcp);
 }
 
-/* Copy default into a cell. */
+/*
+ * Set cell as styled with a single byte character. Returns 0 if it can't be
+ * and an extended cell is needed instead.
+ */
+static int
+grid_styled_cell(struct grid *gd, struct grid_line *gl,
+    struct grid_cell_entry *gce, const struct grid_cell *gc, u_char c)
+{
+	u_int	id;
+
+	if (gce->flags & GRID_FLAG_EXTENDED)
+		return (0);
+	if (grid_style_add(gd->styles, gc, &id) != 0)
+		return (0);
+
+	gl->flags |= GRID_LINE_EXTENDED;
+
+	gce->flags = GRID_FLAG_STYLED;
+	gce->offset = (id << 8) | c;
+	return (1);
+}
+
+/* Copy default into an entry, either a cell or the fill entry. */
 static void
-grid_clear_cell(struct grid *gd, u_int px, u_int py, u_int bg)
+grid_clear_entry(struct grid *gd, u_int py, struct grid_line *gl,
+    struct grid_cell_entry *gce, u_int bg)
 {
-	struct grid_line	*gl = &gd->linedata[py];
-	struct grid_cell_entry	*gce = &gl->celldata[px];
-	struct grid_cell	*gc;
+	struct grid_cell	 gc;
 
 	memcpy(gce, &grid_default_entry, sizeof *gce);
 	if (bg & COLOUR_FLAG_RGB) {
-		gc = grid_extended_cell(gl, gce, &grid_default_cell);
-		gc->bg = bg;
+		memcpy(&gc, &grid_default_cell, sizeof gc);
+		gc.bg = bg;
+		if (!grid_styled_cell(gd, gl, gce, &gc, ' '))
+			grid_extended_cell(gd, py, gl, gce, &gc);
 	} else {
 		if (bg & COLOUR_FLAG_256)
 			gce->flags |= GRID_FLAG_BG256;
@@ -136,6 +647,32 @@ grid_clear_cell(struct grid *gd, u_int px, u_int py, u_int bg)
 	}
 }
 
+/* Copy default into a cell. */
+static void
+grid_clear_cell(struct grid *gd, u_int px, u_int py, u_int bg)
+{
+	struct grid_line	*gl = grid_get_line(gd, py);
+
+	grid_clear_entry(gd, py, gl, &gl->celldata[px], bg);
+}
+
+/* Copy the fill entry into a cell, giving it its own extended cell if any. */
+static void
+grid_fill_cell(struct grid *gd, u_int px, u_int py)
+{
+	struct grid_line	*gl = grid_get_line(gd, py);
+	struct grid_cell_entry	*gce = &gl->celldata[px];
+	struct grid_cell	 gc;
+
+	if (~gl->fill.flags & GRID_FLAG_EXTENDED) {
+		memcpy(gce, &gl->fill, sizeof *gce);
+		return;
+	}
+	memcpy(&gc, &gl->extddata[gl->fill.offset], sizeof gc);
+	memcpy(gce, &grid_default_entry, sizeof *gce);
+	grid_extended_cell(gd, py, gl, gce, &gc);
+}
+
 /* Check grid y position. */
 static int
 grid_check_y(struct grid *gd, u_int py)
@@ -162,6 +699,165 @@ grid_cells_equal(const struct grid_cell *gca, const struct grid_cell *gcb)
 	return (memcmp(gca->data.data, gcb->data.data, gca->data.size) == 0);
 }
 
+/* Discard the logical line index. */
+static void
+grid_index_free(struct grid *gd)
+{
+	if (gd->index != NULL) {
+		free(gd->index->list);
+		free(gd->index);
+		gd->index = NULL;
+	}
+}
+
+/* Build the logical line index from the history. */
+static void
+grid_index_build(struct grid *gd)
+{
+	u_int	yy;
+
+	gd->index = xcalloc(1, sizeof *gd->index);
+	for (yy = 0; yy < gd->hsize; yy++)
+		grid_index_add(gd, yy);
+}
+
+/* Add a history line to the index if it starts a logical line. */
+static void
+grid_index_add(struct grid *gd, u_int py)
+{
+	struct grid_index	*gi = gd->index;
+
+	if (gi == NULL)
+		return;
+	if (py != 0 && grid_ring_line(gd, py - 1)->flags & GRID_LINE_WRAPPED)
+		return;
+
+	if (gi->first + gi->used == gi->size) {
+		if (gi->first != 0) {
+			memmove(gi->list, gi->list + gi->first,
+			    gi->used * sizeof *gi->list);
+			gi->first = 0;
+		} else {
+			gi->size = gi->size * 2 + 64;
+			gi->list = xreallocarray(gi->list, gi->size,
+			    sizeof *gi->list);
+		}
+	}
+	gi->list[gi->first + gi->used++] = gi->base + py;
+}
+
+/*
+ * Remove ny lines from the top of the history from the index. If this leaves
+ * part of a logical line, what is left of it becomes the first.
+ */
+static void
+grid_index_trim(struct grid *gd, u_int ny)
+{
+	struct grid_index	*gi = gd->index;
+
+	if (gi == NULL)
+		return;
+	while (gi->used != 0 && gi->list[gi->first] - gi->base < ny) {
+		gi->first++;
+		gi->used--;
+	}
+	if (ny < gd->hsize &&
+	    (gi->used == 0 || gi->list[gi->first] - gi->base != ny)) {
+		gi->first--;
+		gi->used++;
+		gi->list[gi->first] = gi->base + ny;
+	}
+	gi->base += ny;
+}
+
+/* Find the entry for the logical line containing a history line. */
+static u_int
+grid_index_find(struct grid_index *gi, u_int py)
+{
+	u_int	lo, hi, mid;
+
+	lo = 0;
+	hi = gi->used;
+	while (hi - lo > 1) {
+		mid = lo + (hi - lo) / 2;
+		if (gi->list[gi->first + mid] - gi->base <= py)
+			lo = mid;
+		else
+			hi = mid;
+	}
+	return (lo);
+}
+
+/*
+ * Find the first and last lines of the logical line containing line py. Either
+ * first or last may be NULL.
+ */
+void
+grid_wrapped_lines(struct grid *gd, u_int py, u_int *first, u_int *last)
+{
+	struct grid_index	*gi;
+	u_int			 yy, i, end;
+
+	end = gd->hsize + gd->sy - 1;
+	if (py > end)
+		py = end;
+	if (gd->hsize != 0 && gd->index == NULL)
+		grid_index_build(gd);
+	gi = gd->index;
+
+	if (first != NULL) {
+		yy = py;
+		while (yy > gd->hsize &&
+		    grid_ring_line(gd, yy - 1)->flags & GRID_LINE_WRAPPED)
+			yy--;
+		if (yy == gd->hsize && yy != 0 &&
+		    grid_ring_line(gd, yy - 1)->flags & GRID_LINE_WRAPPED)
+			yy--;
+		if (yy < gd->hsize) {
+			i = grid_index_find(gi, yy);
+			yy = gi->list[gi->first + i] - gi->base;
+		}
+		*first = yy;
+	}
+
+	if (last != NULL) {
+		yy = py;
+		if (yy < gd->hsize) {
+			i = grid_index_find(gi, yy);
+			if (i + 1 < gi->used) {
+				yy = gi->list[gi->first + i + 1] - gi->base;
+				*last = yy - 1;
+				return;
+			}
+			yy = gd->hsize - 1;
+		}
+		while (yy < end &&
+		    grid_ring_line(gd, yy)->flags & GRID_LINE_WRAPPED)
+			yy++;
+		*last = yy;
+	}
+}
+
+/*
+ * Create a grid which uses the arena and styles of another, so lines may be
+ * moved between them without copying. Anything left in its lines when it is
+ * destroyed stays allocated until the arena is.
+ */
+struct grid *
+grid_create_shared(struct grid *gd, u_int sx, u_int sy)
+{
+	struct grid	*new;
+
+	new = grid_create(sx, sy, 0);
+	grid_arena_destroy(new->arena);
+	new->arena = gd->arena;
+	new->arena->references++;
+	grid_styles_free(new->styles);
+	new->styles = gd->styles;
+	new->styles->references++;
+	return (new);
+}
+
 /* Create a new grid. */
 struct grid *
 grid_create(u_int sx, u_int sy, u_int hlimit)
@@ -179,6 +875,21 @@ grid_create(u_int sx, u_int sy, u_int hlimit)
 	gd->hlimit = hlimit;
 
 	gd->linedata = xcalloc(gd->sy, sizeof *gd->linedata);
+	gd->linesize = gd->sy;
+	gd->lineoff = 0;
+
+	gd->hfrozen = 0;
+	gd->hcached = NULL;
+	gd->hcompressed = 0;
+
+	gd->hcellbytes = 0;
+	gd->hextdbytes = 0;
+
+	gd->arena = grid_arena_create();
+	gd->styles = grid_styles_create();
+
+	gd->pending = NULL;
+	gd->index = NULL;
 
 	return (gd);
 }
@@ -187,14 +898,12 @@ grid_create(u_int sx, u_int sy, u_int hlimit)
 void
 grid_destroy(struct grid *gd)
 {
-	struct grid_line	*gl;
-	u_int			 yy;
+	grid_free_pending(gd);
+	grid_block_uncache(gd);
+	grid_index_free(gd);
 
-	for (yy = 0; yy < gd->hsize + gd->sy; yy++) {
-		gl = &gd->linedata[yy];
-		free(gl->celldata);
-		free(gl->extddata);
-	}
+	grid_arena_destroy(gd->arena);
+	grid_styles_free(gd->styles);
 
 	free(gd->linedata);
 
@@ -213,8 +922,8 @@ grid_compare(struct grid *ga, struct grid *gb)
 		return (1);
 
 	for (yy = 0; yy < ga->sy; yy++) {
-		gla = &ga->linedata[yy];
-		glb = &gb->linedata[yy];
+		gla = grid_get_line(ga, yy);
+		glb = grid_get_line(gb, yy);
 		if (gla->cellsize != glb->cellsize)
 			return (1);
 		for (xx = 0; xx < gla->cellsize; xx++) {
@@ -228,26 +937,238 @@ grid_compare(struct grid *ga, struct grid *gb)
 	return (0);
 }
 
+/* Get line from the ring buffer, whether compressed or not. */
+static struct grid_line *
+grid_ring_line(struct grid *gd, u_int py)
+{
+	u_int	yy;
+
+	yy = gd->lineoff + py;
+	if (yy >= gd->linesize)
+		yy -= gd->linesize;
+	return (&gd->linedata[yy]);
+}
+
+/* Get line for writing, uncompressing it if needed. */
+struct grid_line *
+grid_get_line(struct grid *gd, u_int py)
+{
+	struct grid_line	*gl;
+	struct grid_block	*gb;
+	struct grid_line	*bl;
+
+	gl = grid_ring_line(gd, py);
+	if (~gl->flags & GRID_LINE_COMPRESSED)
+		return (gl);
+
+	gb = gl->block;
+	grid_block_cache(gd, gb);
+	bl = &gb->decoded[gl->blockline];
+
+	memcpy(gl, bl, sizeof *gl);
+	bl->celldata = NULL;
+	bl->extddata = NULL;
+	if (py < gd->hsize)
+		grid_count_line(gd, gl, 1);
+
+	grid_block_release(gd, gb);
+	return (gl);
+}
+
+/*
+ * Reallocate the ring buffer with space for size lines, keeping the first used
+ * lines. The lines are unwrapped so they start at the beginning again.
+ */
+static void
+grid_set_line_size(struct grid *gd, u_int used, u_int size)
+{
+	struct grid_line	*linedata;
+	u_int			 first;
+
+	linedata = xcalloc(size, sizeof *linedata);
+
+	first = gd->linesize - gd->lineoff;
+	if (first > used)
+		first = used;
+	memcpy(linedata, gd->linedata + gd->lineoff, first * sizeof *linedata);
+	memcpy(linedata + first, gd->linedata,
+	    (used - first) * sizeof *linedata);
+
+	free(gd->linedata);
+	gd->linedata = linedata;
+	gd->linesize = size;
+	gd->lineoff = 0;
+}
+
+/*
+ * Make sure there is space for at least lines lines. The ring is doubled in
+ * size each time, but not beyond what the history limit needs unless the
+ * history is already over it.
+ */
+static void
+grid_grow_lines(struct grid *gd, u_int lines)
+{
+	u_int	size, limit;
+
+	if (lines <= gd->linesize)
+		return;
+
+	size = gd->linesize * 2;
+	limit = gd->hlimit + gd->sy + 1;
+	if (size > limit && limit > gd->linesize)
+		size = limit;
+	if (size < lines)
+		size = lines;
+	grid_set_line_size(gd, gd->linesize, size);
+}
+
+/* Adjust the number of lines available to at least lines. */
+void
+grid_adjust_lines(struct grid *gd, u_int lines)
+{
+	if (lines > gd->linesize)
+		grid_set_line_size(gd, gd->linesize, lines);
+}
+
+/* Move line entries within the ring buffer without freeing anything. */
+static void
+grid_copy_lines(struct grid *gd, u_int dy, u_int py, u_int ny)
+{
+	u_int	yy;
+
+	for (yy = 0; yy < ny; yy++) {
+		if (py + yy < gd->hsize)
+			grid_count_line(gd, grid_ring_line(gd, py + yy), 0);
+	}
+	if (dy < py) {
+		for (yy = 0; yy < ny; yy++) {
+			memcpy(grid_ring_line(gd, dy + yy),
+			    grid_ring_line(gd, py + yy), sizeof *gd->linedata);
+		}
+	} else if (dy > py) {
+		for (yy = ny; yy > 0; yy--) {
+			memcpy(grid_ring_line(gd, dy + yy - 1),
+			    grid_ring_line(gd, py + yy - 1),
+			    sizeof *gd->linedata);
+		}
+	}
+	for (yy = 0; yy < ny; yy++) {
+		if (dy + yy < gd->hsize)
+			grid_count_line(gd, grid_ring_line(gd, dy + yy), 1);
+	}
+}
+
+/* Add or remove a line in the history byte counts. */
+static void
+grid_count_line(struct grid *gd, const struct grid_line *gl, int add)
+{
+	size_t	cells, extd;
+
+	if (gl->flags & GRID_LINE_COMPRESSED)
+		return;
+	cells = gl->cellstored * sizeof *gl->celldata;
+	extd = gl->extdsize * sizeof *gl->extddata;
+
+	if (add) {
+		gd->hcellbytes += cells;
+		gd->hextdbytes += extd;
+	} else {
+		gd->hcellbytes -= cells;
+		gd->hextdbytes -= extd;
+	}
+}
+
+/* Free the data for a set of lines and empty them. */
+static void
+grid_free_lines(struct grid *gd, u_int py, u_int ny)
+{
+	struct grid_line	*gl;
+	u_int			 yy;
+
+	for (yy = py; yy < py + ny; yy++) {
+		gl = grid_ring_line(gd, yy);
+		if (yy < gd->hsize)
+			grid_count_line(gd, gl, 0);
+		if (gl->flags & GRID_LINE_COMPRESSED)
+			grid_block_release(gd, gl->block);
+		else {
+			grid_free(gl->celldata);
+			grid_free(gl->extddata);
+		}
+		memset(gl, 0, sizeof *gl);
+	}
+}
+
 /*
  * Collect lines from the history if at the limit. Free the top (oldest) 10%
- * and shift up.
+ * and move the start of the ring past them.
  */
 void
-grid_collect_history(struct grid *gd, u_int bg)
+grid_collect_history(struct grid *gd, __unused u_int bg)
 {
 	u_int	yy;
 
-	if (gd->hsize < gd->hlimit)
+	yy = gd->hsize;
+	if (gd->pending != NULL)
+		yy += gd->pending->hsize;
+	if (yy < gd->hlimit)
 		return;
 
 	yy = gd->hlimit / 10;
 	if (yy < 1)
 		yy = 1;
+	grid_trim_history(gd, yy);
+}
+
+/*
+ * Free lines from the top (oldest) of the history, starting with any which are
+ * still to be reflowed.
+ */
+void
+grid_trim_history(struct grid *gd, u_int ny)
+{
+	struct grid	*pg = gd->pending;
+	u_int		 n;
+
+	if (pg != NULL) {
+		n = ny;
+		if (n > pg->hsize)
+			n = pg->hsize;
+		grid_trim_history(pg, n);
+		if (pg->hsize == 0)
+			grid_free_pending(gd);
+		ny -= n;
+	}
+
+	if (ny > gd->hsize)
+		ny = gd->hsize;
+	if (ny == 0)
+		return;
 
-	grid_move_lines(gd, 0, yy, gd->hsize + gd->sy - yy, bg);
-	gd->hsize -= yy;
+	grid_free_lines(gd, 0, ny);
+	gd->lineoff += ny;
+	if (gd->lineoff >= gd->linesize)
+		gd->lineoff -= gd->linesize;
+
+	if (gd->hfrozen > ny)
+		gd->hfrozen -= ny;
+	else
+		gd->hfrozen = 0;
+
+	grid_index_trim(gd, ny);
+	gd->hsize -= ny;
 	if (gd->hscrolled > gd->hsize)
 		gd->hscrolled = gd->hsize;
+
+	/*
+	 * If the history is now empty and the style table has more styles than
+	 * could be on the screen, it is mostly styles no longer used, so
+	 * rebuild it rather than letting it fill up.
+	 */
+	if (gd->hsize == 0 && gd->pending == NULL &&
+	    gd->styles->references == 1 &&
+	    gd->styles->size > gd->sx * gd->sy)
+		grid_reset_styles(gd);
 }
 
 /*
@@ -260,70 +1181,121 @@ grid_scroll_history(struct grid *gd, u_int bg)
 	u_int	yy;
 
 	yy = gd->hsize + gd->sy;
-	gd->linedata = xreallocarray(gd->linedata, yy + 1,
-	    sizeof *gd->linedata);
+	grid_grow_lines(gd, yy + 1);
 	grid_empty_line(gd, yy, bg);
 
+	grid_count_line(gd, grid_ring_line(gd, gd->hsize), 1);
 	gd->hscrolled++;
 	gd->hsize++;
+	grid_index_add(gd, gd->hsize - 1);
+
+	grid_compress_history(gd);
 }
 
-/* Clear the history. */
+/*
+ * Clear the history. The visible lines are copied into a new arena and the old
+ * one destroyed, rather than freeing each history line. The style table is
+ * rebuilt from the visible lines too.
+ */
 void
 grid_clear_history(struct grid *gd)
 {
-	grid_clear_lines(gd, 0, gd->hsize, 8);
-	grid_move_lines(gd, 0, gd->hsize, gd->sy, 8);
+	struct grid_arena	*ga = gd->arena;
+	struct grid_line	*gl;
+	void			*data;
+	size_t			 size;
+	u_int			 yy;
+
+	grid_free_pending(gd);
+	grid_index_free(gd);
+
+	/* Uncompress visible lines into the old arena before copying them. */
+	for (yy = gd->hsize; yy < gd->hsize + gd->sy; yy++)
+		grid_get_line(gd, yy);
+
+	gd->arena = grid_arena_create();
+	for (yy = gd->hsize; yy < gd->hsize + gd->sy; yy++) {
+		gl = grid_ring_line(gd, yy);
+
+		data = NULL;
+		if (gl->cellstored != 0) {
+			size = gl->cellstored * sizeof *gl->celldata;
+			data = grid_alloc(gd, size);
+			memcpy(data, gl->celldata, size);
+		}
+		gl->celldata = data;
+
+		data = NULL;
+		if (gl->extdsize != 0) {
+			size = gl->extdsize * sizeof *gl->extddata;
+			data = grid_alloc(gd, size);
+			memcpy(data, gl->extddata, size);
+		}
+		gl->extddata = data;
+	}
+	grid_block_uncache(gd);
+	grid_arena_destroy(ga);
+	grid_reset_styles(gd);
+
+	gd->lineoff += gd->hsize;
+	if (gd->lineoff >= gd->linesize)
+		gd->lineoff -= gd->linesize;
 
 	gd->hscrolled = 0;
 	gd->hsize = 0;
+	gd->hfrozen = 0;
+	gd->hcompressed = 0;
+	gd->hcellbytes = 0;
+	gd->hextdbytes = 0;
 
-	gd->linedata = xreallocarray(gd->linedata, gd->sy,
-	    sizeof *gd->linedata);
+	grid_set_line_size(gd, gd->sy, gd->sy);
 }
 
 /* Scroll a region up, moving the top line into the history. */
 void
 grid_scroll_history_region(struct grid *gd, u_int upper, u_int lower, u_int bg)
 {
-	struct grid_line	*gl_history, *gl_upper;
-	u_int			 yy;
+	u_int	yy;
 
 	/* Create a space for a new line. */
 	yy = gd->hsize + gd->sy;
-	gd->linedata = xreallocarray(gd->linedata, yy + 1,
-	    sizeof *gd->linedata);
+	grid_grow_lines(gd, yy + 1);
 
 	/* Move the entire screen down to free a space for this line. */
-	gl_history = &gd->linedata[gd->hsize];
-	memmove(gl_history + 1, gl_history, gd->sy * sizeof *gl_history);
+	grid_copy_lines(gd, gd->hsize + 1, gd->hsize, gd->sy);
 
 	/* Adjust the region and find its start and end. */
 	upper++;
-	gl_upper = &gd->linedata[upper];
 	lower++;
 
 	/* Move the line into the history. */
-	memcpy(gl_history, gl_upper, sizeof *gl_history);
+	grid_copy_lines(gd, gd->hsize, upper, 1);
 
 	/* Then move the region up and clear the bottom line. */
-	memmove(gl_upper, gl_upper + 1, (lower - upper) * sizeof *gl_upper);
+	grid_copy_lines(gd, upper, upper + 1, lower - upper);
 	grid_empty_line(gd, lower, bg);
 
 	/* Move the history offset down over the line. */
+	grid_count_line(gd, grid_ring_line(gd, gd->hsize), 1);
 	gd->hscrolled++;
 	gd->hsize++;
+	grid_index_add(gd, gd->hsize - 1);
+
+	grid_compress_history(gd);
 }
 
-/* Expand line to fit to cell. */
+/*
+ * Expand line to fit to cell. Cells inside the fill run are given the fill
+ * entry and cells beyond the end of the line are cleared with bg.
+ */
 static void
 grid_expand_line(struct grid *gd, u_int py, u_int sx, u_int bg)
 {
 	struct grid_line	*gl;
 	u_int			 xx;
 
-	gl = &gd->linedata[py];
-	if (sx <= gl->cellsize)
+	gl = grid_get_line(gd, py);
+	if (sx <= gl->cellstored)
 		return;
 
 	if (sx < gd->sx / 4)
@@ -333,44 +1305,94 @@ grid_expand_line(struct grid *gd, u_int py, u_int sx, u_int bg)
 	else
 		sx = gd->sx;
 
-	gl->celldata = xreallocarray(gl->celldata, sx, sizeof *gl->celldata);
-	for (xx = gl->cellsize; xx < sx; xx++)
-		grid_clear_cell(gd, xx, py, bg);
-	gl->cellsize = sx;
+	if (py < gd->hsize) {
+		gd->hcellbytes -= gl->cellstored * sizeof *gl->celldata;
+		gd->hcellbytes += sx * sizeof *gl->celldata;
+	}
+
+	gl->celldata = grid_realloc(gd, gl->celldata, sx, sizeof *gl->celldata);
+	for (xx = gl->cellstored; xx < sx; xx++) {
+		if (xx < gl->cellsize)
+			grid_fill_cell(gd, xx, py);
+		else
+			grid_clear_cell(gd, xx, py, bg);
+	}
+	gl->cellstored = sx;
+	if (sx > gl->cellsize)
+		gl->cellsize = sx;
+}
+
+/* Replace the cells from px to the end of the line with a run of bg. */
+static void
+grid_fill_line(struct grid *gd, u_int py, u_int px, u_int nx, u_int bg)
+{
+	struct grid_line	*gl;
+
+	grid_expand_line(gd, py, px, 8);
+
+	gl = grid_get_line(gd, py);
+	if (gl->cellstored > px) {
+		if (py < gd->hsize) {
+			gd->hcellbytes -= (gl->cellstored - px) *
+			    sizeof *gl->celldata;
+		}
+		gl->cellstored = px;
+	}
+	grid_clear_entry(gd, py, gl, &gl->fill, bg);
+	gl->cellsize = px + nx;
 }
 
 /* Empty a line and set background colour if needed. */
 static void
 grid_empty_line(struct grid *gd, u_int py, u_int bg)
 {
-	memset(&gd->linedata[py], 0, sizeof gd->linedata[py]);
+	memset(grid_ring_line(gd, py), 0, sizeof *gd->linedata);
 	if (bg != 8)
-		grid_expand_line(gd, py, gd->sx, bg);
+		grid_fill_line(gd, py, 0, gd->sx, bg);
 }
 
-/* Peek at grid line. */
+/*
+ * Peek at grid line. A compressed line is read from the block cache, so the
+ * line is only valid until a line from another block is peeked or the grid is
+ * changed. Callers use one peeked line at a time.
+ */
 const struct grid_line *
 grid_peek_line(struct grid *gd, u_int py)
 {
+	struct grid_line	*gl;
+
 	if (grid_check_y(gd, py) != 0)
 		return (NULL);
-	return (&gd->linedata[py]);
+
+	gl = grid_ring_line(gd, py);
+	if (~gl->flags & GRID_LINE_COMPRESSED)
+		return (gl);
+	grid_block_cache(gd, gl->block);
+	return (&gl->block->decoded[gl->blockline]);
 }
 
 /* Get cell for reading. */
 void
 grid_get_cell(struct grid *gd, u_int px, u_int py, struct grid_cell *gc)
 {
-	struct grid_line	*gl;
-	struct grid_cell_entry	*gce;
+	const struct grid_line		*gl;
+	const struct grid_cell_entry	*gce;
 
-	if (grid_check_y(gd, py) != 0 || px >= gd->linedata[py].cellsize) {
+	gl = grid_peek_line(gd, py);
+	if (gl == NULL || px >= gl->cellsize) {
 		memcpy(gc, &grid_default_cell, sizeof *gc);
 		return;
 	}
+	if (px < gl->cellstored)
+		gce = &gl->celldata[px];
+	else
+		gce = &gl->fill;
 
-	gl = &gd->linedata[py];
-	gce = &gl->celldata[px];
+	if (gce->flags & GRID_FLAG_STYLED) {
+		grid_style_get(gd->styles, gce->offset >> 8, gc);
+		utf8_set(&gc->data, gce->offset & 0xff);
+		return;
+	}
 
 	if (gce->flags & GRID_FLAG_EXTENDED) {
 		if (gce->offset >= gl->extdsize)
@@ -391,6 +1413,57 @@ grid_get_cell(struct grid *gd, u_int px, u_int py, struct grid_cell *gc)
 	utf8_set(&gc->data, gce->data.data);
 }
 
+/*
+ * Get the characters of nx cells from px as one byte each, reading the cell
+ * entries directly. Returns 0 if any is padding or has a character longer than
+ * one byte, in which case the cells must be looked at one at a time.
+ */
+int
+grid_line_chars(struct grid *gd, u_int px, u_int py, u_int nx, u_char *buf)
+{
+	const struct grid_line		*gl;
+	const struct grid_cell_entry	*gce;
+	const struct grid_cell		*gc;
+	u_int				 xx, end;
+
+	gl = grid_peek_line(gd, py);
+	end = px + nx;
+	if (gl == NULL || px >= gl->cellsize) {
+		memset(buf, ' ', nx);
+		return (1);
+	}
+	if (end > gl->cellsize) {
+		memset(buf + (gl->cellsize - px), ' ', end - gl->cellsize);
+		end = gl->cellsize;
+	}
+
+	for (xx = px; xx < end; xx++) {
+		if (xx < gl->cellstored)
+			gce = &gl->celldata[xx];
+		else
+			gce = &gl->fill;
+		if (gce->flags & GRID_FLAG_PADDING)
+			return (0);
+
+		if (gce->flags & GRID_FLAG_STYLED)
+			*buf++ = gce->offset & 0xff;
+		else if (gce->flags & GRID_FLAG_EXTENDED) {
+			if (gce->offset >= gl->extdsize) {
+				*buf++ = ' ';
+				continue;
+			}
+			gc = &gl->extddata[gce->offset];
+			if (gc->flags & GRID_FLAG_PADDING ||
+			    gc->data.size != 1 ||
+			    gc->data.width != 1)
+				return (0);
+			*buf++ = gc->data.data[0];
+		} else
+			*buf++ = gce->data.data;
+	}
+	return (1);
+}
+
 /* Set cell at relative position. */
 void
 grid_set_cell(struct grid *gd, u_int px, u_int py, const struct grid_cell *gc)
@@ -403,15 +1476,17 @@ grid_set_cell(struct grid *gd, u_int px, u_int py, const struct grid_cell *gc)
 
 	grid_expand_line(gd, py, px + 1, 8);
 
-	gl = &gd->linedata[py];
+	gl = grid_get_line(gd, py);
 	if (px + 1 > gl->cellused)
 		gl->cellused = px + 1;
 
 	gce = &gl->celldata[px];
-	if (grid_need_extended_cell(gce, gc))
-		grid_extended_cell(gl, gce, gc);
-	else
+	if (!grid_need_extended_cell(gce, gc))
 		grid_store_cell(gce, gc, gc->data.data[0]);
+	else if (gc->data.size != 1 ||
+	    gc->data.width != 1 ||
+	    !grid_styled_cell(gd, gl, gce, gc, gc->data.data[0]))
+		grid_extended_cell(gd, py, gl, gce, gc);
 }
 
 /* Set cells at relative position. */
@@ -429,17 +1504,18 @@ grid_set_cells(struct grid *gd, u_int px, u_int py, const struct grid_cell *gc,
 
 	grid_expand_line(gd, py, px + slen, 8);
 
-	gl = &gd->linedata[py];
+	gl = grid_get_line(gd, py);
 	if (px + slen > gl->cellused)
 		gl->cellused = px + slen;
 
 	for (i = 0; i < slen; i++) {
 		gce = &gl->celldata[px + i];
-		if (grid_need_extended_cell(gce, gc)) {
-			gcp = grid_extended_cell(gl, gce, gc);
-			utf8_set(&gcp->data, s[i]);
-		} else
+		if (!grid_need_extended_cell(gce, gc))
 			grid_store_cell(gce, gc, s[i]);
+		else if (!grid_styled_cell(gd, gl, gce, gc, s[i])) {
+			gcp = grid_extended_cell(gd, py, gl, gce, gc);
+			utf8_set(&gcp->data, s[i]);
+		}
 	}
 }
 
@@ -447,7 +1523,8 @@ grid_set_cells(struct grid *gd, u_int px, u_int py, const struct grid_cell *gc,
 void
 grid_clear(struct grid *gd, u_int px, u_int py, u_int nx, u_int ny, u_int bg)
 {
-	u_int	xx, yy;
+	struct grid_line	*gl;
+	u_int			 xx, yy;
 
 	if (nx == 0 || ny == 0)
 		return;
@@ -463,12 +1540,24 @@ grid_clear(struct grid *gd, u_int px, u_int py, u_int nx, u_int ny, u_int bg)
 		return;
 
 	for (yy = py; yy < py + ny; yy++) {
-		if (px + nx >= gd->sx && px < gd->linedata[yy].cellused)
-			gd->linedata[yy].cellused = px;
-		if (px > gd->linedata[yy].cellsize && bg == 8)
+		gl = grid_get_line(gd, yy);
+		if (px + nx >= gd->sx && px < gl->cellused)
+			gl->cellused = px;
+		if (px > gl->cellsize && bg == 8)
+			continue;
+		if (px + nx >= gl->cellsize && bg == 8) {
+			if (gl->cellstored > px) {
+				if (yy < gd->hsize) {
+					gd->hcellbytes -= (gl->cellstored -
+					    px) * sizeof *gl->celldata;
+				}
+				gl->cellstored = px;
+			}
+			gl->cellsize = px;
 			continue;
-		if (px + nx >= gd->linedata[yy].cellsize && bg == 8) {
-			gd->linedata[yy].cellsize = px;
+		}
+		if (px + nx >= gl->cellsize && px + nx >= gd->sx) {
+			grid_fill_line(gd, yy, px, nx, bg);
 			continue;
 		}
 		grid_expand_line(gd, yy, px + nx, 8); /* default bg first */
@@ -481,8 +1570,7 @@ grid_clear(struct grid *gd, u_int px, u_int py, u_int nx, u_int ny, u_int bg)
 void
 grid_clear_lines(struct grid *gd, u_int py, u_int ny, u_int bg)
 {
-	struct grid_line	*gl;
-	u_int			 yy;
+	u_int	yy;
 
 	if (ny == 0)
 		return;
@@ -493,9 +1581,7 @@ grid_clear_lines(struct grid *gd, u_int py, u_int ny, u_int bg)
 		return;
 
 	for (yy = py; yy < py + ny; yy++) {
-		gl = &gd->linedata[yy];
-		free(gl->celldata);
-		free(gl->extddata);
+		grid_free_lines(gd, yy, 1);
 		grid_empty_line(gd, yy, bg);
 	}
 }
@@ -525,8 +1611,7 @@ grid_move_lines(struct grid *gd, u_int dy, u_int py, u_int ny, u_int bg)
 		grid_clear_lines(gd, yy, 1, bg);
 	}
 
-	memmove(&gd->linedata[dy], &gd->linedata[py],
-	    ny * (sizeof *gd->linedata));
+	grid_copy_lines(gd, dy, py, ny);
 
 	/* Wipe any lines that have been moved (without freeing them). */
 	for (yy = py; yy < py + ny; yy++) {
@@ -548,7 +1633,7 @@ grid_move_cells(struct grid *gd, u_int dx, u_int px, u_int py, u_int nx,
 
 	if (grid_check_y(gd, py) != 0)
 		return;
-	gl = &gd->linedata[py];
+	gl = grid_get_line(gd, py);
 
 	grid_expand_line(gd, py, px + nx, 8);
 	grid_expand_line(gd, py, dx + nx, 8);
@@ -800,6 +1885,22 @@ grid_string_cells(struct grid *gd, u_int px, u_int py, u_int nx,
 	off = 0;
 
 	gl = grid_peek_line(gd, py);
+
+	/* Copy lines of only single byte characters straight from the cells. */
+	if (!with_codes && !escape_c0 && gl != NULL && px < gl->cellsize) {
+		size = gl->cellsize - px;
+		if (size > nx)
+			size = nx;
+		if (size + 1 > len) {
+			len = size + 1;
+			buf = xrealloc(buf, len);
+		}
+		if (grid_line_chars(gd, px, py, size, (u_char *)buf)) {
+			off = size;
+			nx = 0;
+		}
+	}
+
 	for (xx = px; xx < px + nx; xx++) {
 		if (gl == NULL || xx >= gl->cellsize)
 			break;
@@ -844,6 +1945,36 @@ grid_string_cells(struct grid *gd, u_int px, u_int py, u_int nx,
 	return (buf);
 }
 
+/* Move styled cells in a line from another style table to this grid's. */
+static void
+grid_restyle_line(struct grid *gd, u_int py, struct grid_line *gl,
+    struct grid_styles *gss)
+{
+	struct grid_cell_entry	*gce;
+	struct grid_cell	 gc;
+	u_char			 c;
+	u_int			 xx;
+
+	for (xx = 0; xx <= gl->cellstored; xx++) {
+		if (xx < gl->cellstored)
+			gce = &gl->celldata[xx];
+		else if (gl->cellsize > gl->cellstored)
+			gce = &gl->fill;
+		else
+			break;
+		if (~gce->flags & GRID_FLAG_STYLED)
+			continue;
+
+		grid_style_get(gss, gce->offset >> 8, &gc);
+		c = gce->offset & 0xff;
+		utf8_set(&gc.data, c);
+
+		memcpy(gce, &grid_default_entry, sizeof *gce);
+		if (!grid_styled_cell(gd, gl, gce, &gc, c))
+			grid_extended_cell(gd, py, gl, gce, &gc);
+	}
+}
+
 /*
  * Duplicate a set of lines between two grids. If there aren't enough lines in
  * either source or destination, the number of lines is limited to the number
@@ -853,7 +1984,8 @@ void
 grid_duplicate_lines(struct grid *dst, u_int dy, struct grid *src, u_int sy,
     u_int ny)
 {
-	struct grid_line	*dstl, *srcl;
+	struct grid_line	*dstl;
+	const struct grid_line	*srcl;
 	u_int			 yy;
 
 	if (dy + ny > dst->hsize + dst->sy)
@@ -861,37 +1993,85 @@ grid_duplicate_lines(struct grid *dst, u_int dy, struct grid *src, u_int sy,
 	if (sy + ny > src->hsize + src->sy)
 		ny = src->hsize + src->sy - sy;
 	grid_clear_lines(dst, dy, ny, 8);
+	if (dy < dst->hsize)
+		grid_index_free(dst);
 
 	for (yy = 0; yy < ny; yy++) {
-		srcl = &src->linedata[sy];
-		dstl = &dst->linedata[dy];
+		dstl = grid_get_line(dst, dy);
+		srcl = grid_peek_line(src, sy);
 
 		memcpy(dstl, srcl, sizeof *dstl);
-		if (srcl->cellsize != 0) {
-			dstl->celldata = xreallocarray(NULL,
-			    srcl->cellsize, sizeof *dstl->celldata);
+		if (srcl->cellstored != 0) {
+			dstl->celldata = grid_alloc(dst,
+			    srcl->cellstored * sizeof *dstl->celldata);
 			memcpy(dstl->celldata, srcl->celldata,
-			    srcl->cellsize * sizeof *dstl->celldata);
+			    srcl->cellstored * sizeof *dstl->celldata);
 		} else
 			dstl->celldata = NULL;
 
 		if (srcl->extdsize != 0) {
 			dstl->extdsize = srcl->extdsize;
-			dstl->extddata = xreallocarray(NULL, dstl->extdsize,
+			dstl->extddata = grid_alloc(dst, dstl->extdsize *
 			    sizeof *dstl->extddata);
 			memcpy(dstl->extddata, srcl->extddata, dstl->extdsize *
 			    sizeof *dstl->extddata);
-		}
+		} else
+			dstl->extddata = NULL;
+		if (dy < dst->hsize)
+			grid_count_line(dst, dstl, 1);
+		if (dstl->flags & GRID_LINE_EXTENDED)
+			grid_restyle_line(dst, dy, dstl, src->styles);
 
 		sy++;
 		dy++;
 	}
 }
 
+/*
+ * Move lines from one grid to another, leaving them empty. If the grids share
+ * an arena and styles only the line entries are moved, otherwise the data is
+ * copied.
+ */
+void
+grid_take_lines(struct grid *dst, u_int dy, struct grid *src, u_int sy,
+    u_int ny)
+{
+	struct grid_line	*dstl, *srcl;
+	u_int			 yy;
+
+	if (dy + ny > dst->hsize + dst->sy)
+		ny = dst->hsize + dst->sy - dy;
+	if (sy + ny > src->hsize + src->sy)
+		ny = src->hsize + src->sy - sy;
+
+	if (dst->arena != src->arena || dst->styles != src->styles) {
+		grid_duplicate_lines(dst, dy, src, sy, ny);
+		grid_clear_lines(src, sy, ny, 8);
+		return;
+	}
+	grid_clear_lines(dst, dy, ny, 8);
+	if (dy < dst->hsize)
+		grid_index_free(dst);
+	if (sy < src->hsize)
+		grid_index_free(src);
+
+	for (yy = 0; yy < ny; yy++) {
+		srcl = grid_get_line(src, sy + yy);
+		if (sy + yy < src->hsize)
+			grid_count_line(src, srcl, 0);
+		dstl = grid_get_line(dst, dy + yy);
+
+		memcpy(dstl, srcl, sizeof *dstl);
+		memset(srcl, 0, sizeof *srcl);
+		if (dy + yy < dst->hsize)
+			grid_count_line(dst, dstl, 1);
+	}
+}
+
 /* Copy a section of a line. */
 static void
-grid_reflow_copy(struct grid_line *dst_gl, u_int to, struct grid_line *src_gl,
-    u_int from, u_int to_copy)
+grid_reflow_copy(struct grid *dst, struct grid_line *dst_gl, u_int to,
+    struct grid_line *src_gl, u_int from, u_int to_copy)
 {
 	struct grid_cell_entry	*gce;
 	u_int			 i, was;
@@ -905,7 +2085,7 @@ grid_reflow_copy(struct grid_line *dst_gl, u_int to, struct grid_line *src_gl,
 			continue;
 		was = gce->offset;
 
-		dst_gl->extddata = xreallocarray(dst_gl->extddata,
+		dst_gl->extddata = grid_realloc(dst, dst_gl->extddata,
 		    dst_gl->extdsize + 1, sizeof *dst_gl->extddata);
 		gce->offset = dst_gl->extdsize++;
 		memcpy(&dst_gl->extddata[gce->offset], &src_gl->extddata[was],
@@ -918,7 +2098,7 @@ static void
 grid_reflow_join(struct grid *dst, u_int *py, struct grid_line *src_gl,
     u_int new_x)
 {
-	struct grid_line	*dst_gl = &dst->linedata[(*py) - 1];
+	struct grid_line	*dst_gl = grid_get_line(dst, (*py) - 1);
 	u_int			 left, to_copy, ox, nx;
 
 	/* How much is left on the old line? */
@@ -932,12 +2112,12 @@ grid_reflow_join(struct grid *dst, u_int *py, struct grid_line *src_gl,
 	nx = ox + to_copy;
 
 	/* Resize the destination line. */
-	dst_gl->celldata = xreallocarray(dst_gl->celldata, nx,
+	dst_gl->celldata = grid_realloc(dst, dst_gl->celldata, nx,
 	    sizeof *dst_gl->celldata);
-	dst_gl->cellsize = dst_gl->cellused = nx;
+	dst_gl->cellsize = dst_gl->cellstored = dst_gl->cellused = nx;
 
 	/* Append as much as possible. */
-	grid_reflow_copy(dst_gl, ox, src_gl, 0, to_copy);
+	grid_reflow_copy(dst, dst_gl, ox, src_gl, 0, to_copy);
 
 	/* If there is any left in the source, split it. */
 	if (src_gl->cellused > to_copy) {
@@ -961,7 +2141,7 @@ grid_reflow_split(struct grid *dst, u_int *py, struct grid_line *src_gl,
 		/* Create new line. */
 		if (*py >= dst->hsize + dst->sy)
 			grid_scroll_history(dst, 8);
-		dst_gl = &dst->linedata[*py];
+		dst_gl = grid_get_line(dst, *py);
 		(*py)++;
 
 		/* How much should we copy? */
@@ -970,13 +2150,14 @@ grid_reflow_split(struct grid *dst, u_int *py, struct grid_line *src_gl,
 			to_copy = src_gl->cellused;
 
 		/* Expand destination line. */
-		dst_gl->celldata = xreallocarray(NULL, to_copy,
-		    sizeof *dst_gl->celldata);
+		dst_gl->celldata = grid_alloc(dst,
+		    to_copy * sizeof *dst_gl->celldata);
 		dst_gl->cellsize = dst_gl->cellused = to_copy;
+		dst_gl->cellstored = to_copy;
 		dst_gl->flags |= GRID_LINE_WRAPPED;
 
 		/* Copy the data. */
-		grid_reflow_copy(dst_gl, 0, src_gl, offset, to_copy);
+		grid_reflow_copy(dst, dst_gl, 0, src_gl, offset, to_copy);
 
 		/* Move offset and reduce old line size. */
 		offset += to_copy;
@@ -997,7 +2178,7 @@ grid_reflow_move(struct grid *dst, u_int *py, struct grid_line *src_gl)
 	/* Create new line. */
 	if (*py >= dst->hsize + dst->sy)
 		grid_scroll_history(dst, 8);
-	dst_gl = &dst->linedata[*py];
+	dst_gl = grid_get_line(dst, *py);
 	(*py)++;
 
 	/* Copy the old line. */
@@ -1012,40 +2193,615 @@ grid_reflow_move(struct grid *dst, u_int *py, struct grid_line *src_gl)
 /*
  * Reflow lines from src grid into dst grid of width new_x. Returns number of
  * lines fewer in the visible area. The source grid is destroyed.
+ *
+ * The destination must be empty. Both grids share the source arena while
+ * reflowing so lines which do not change can be moved rather than copied, then
+ * the source is given an empty arena before it is destroyed. The destination
+ * also takes the source styles, so styled cells need no change.
  */
 u_int
 grid_reflow(struct grid *dst, struct grid *src, u_int new_x)
 {
-	u_int			 py, sy, line;
-	int			 previous_wrapped;
-	struct grid_line	*src_gl;
+	u_int			 py, sy, start;
+	struct grid_styles	*gss;
 
 	py = 0;
 	sy = src->sy;
 
+	grid_arena_destroy(dst->arena);
+	dst->arena = src->arena;
+
+	gss = dst->styles;
+	dst->styles = src->styles;
+	src->styles = gss;
+
+	/* Reflow the screen and some history, leave the rest for later. */
+	start = grid_reflow_start(src, new_x, sy + GRID_REFLOW_LINES);
+	grid_reflow_lines(dst, &py, src, start, src->hsize + sy, new_x);
+
+	dst->pending = src->pending;
+	src->pending = NULL;
+	if (start != 0)
+		grid_reflow_defer(dst, src, start);
+
+	grid_block_uncache(src);
+	src->arena = grid_arena_create();
+	grid_destroy(src);
+
+	if (py > sy)
+		return (0);
+	return (sy - py);
+}
+
+/*
+ * Find where to start reflowing so that at least lines lines will result. This
+ * is always the first line of a group of wrapped lines.
+ */
+static u_int
+grid_reflow_start(struct grid *gd, u_int new_x, u_int lines)
+{
+	u_int	yy, start, count;
+	size_t	cells;
+
+	yy = gd->hsize + gd->sy;
+	count = 0;
+	while (yy > 0 && count < lines) {
+		start = yy - 1;
+		cells = grid_ring_line(gd, start)->cellused;
+		while (start > 0 &&
+		    grid_ring_line(gd, start - 1)->flags & GRID_LINE_WRAPPED) {
+			start--;
+			cells += grid_ring_line(gd, start)->cellused;
+		}
+
+		if (cells <= new_x)
+			count++;
+		else
+			count += (cells + new_x - 1) / new_x;
+		yy = start;
+	}
+	return (yy);
+}
+
+/* Reflow lines from src from line from up to line to into dst at py. */
+static void
+grid_reflow_lines(struct grid *dst, u_int *py, struct grid *src, u_int from,
+    u_int to, u_int new_x)
+{
+	u_int			 line;
+	int			 previous_wrapped;
+	struct grid_line	*src_gl;
+
 	previous_wrapped = 0;
-	for (line = 0; line < sy + src->hsize; line++) {
-		src_gl = src->linedata + line;
+	for (line = from; line < to; line++) {
+		src_gl = grid_get_line(src, line);
+		if (line < src->hsize)
+			grid_count_line(src, src_gl, 0);
 		if (!previous_wrapped) {
 			/* Wasn't wrapped. If smaller, move to destination. */
 			if (src_gl->cellused <= new_x)
-				grid_reflow_move(dst, &py, src_gl);
+				grid_reflow_move(dst, py, src_gl);
 			else
-				grid_reflow_split(dst, &py, src_gl, new_x, 0);
+				grid_reflow_split(dst, py, src_gl, new_x, 0);
 		} else {
 			/* Previous was wrapped. Try to join. */
-			grid_reflow_join(dst, &py, src_gl, new_x);
+			grid_reflow_join(dst, py, src_gl, new_x);
 		}
 		previous_wrapped = (src_gl->flags & GRID_LINE_WRAPPED);
 
+		/* Free anything that was copied rather than moved. */
+		grid_free(src_gl->celldata);
+		grid_free(src_gl->extddata);
+		src_gl->celldata = NULL;
+		src_gl->extddata = NULL;
+
 		/* This is where we started scrolling. */
-		if (line == sy + src->hsize - src->hscrolled - 1)
+		if (line == src->sy + src->hsize - src->hscrolled - 1)
 			dst->hscrolled = 0;
 	}
+}
 
-	grid_destroy(src);
+/*
+ * Move the first ny lines of src to the end of the pending history of gd,
+ * creating it if needed.
+ */
+static void
+grid_reflow_defer(struct grid *gd, struct grid *src, u_int ny)
+{
+	struct grid		*pg;
+	struct grid_line	*gl;
+	u_int			 yy, first, scrolled;
 
-	if (py > sy)
+	if ((pg = gd->pending) == NULL) {
+		pg = gd->pending = grid_create_shared(gd, gd->sx, 1);
+		pg->sy = 0;
+	}
+
+	grid_adjust_lines(pg, pg->hsize + ny);
+	for (yy = 0; yy < ny; yy++) {
+		gl = grid_ring_line(pg, pg->hsize + yy);
+		memcpy(gl, grid_ring_line(src, yy), sizeof *gl);
+		memset(grid_ring_line(src, yy), 0, sizeof *gl);
+		grid_count_line(pg, gl, 1);
+	}
+	pg->hsize += ny;
+	pg->hcompressed += src->hcompressed;
+	src->hcompressed = 0;
+
+	/* Work out how many of the lines are in the scrolled history. */
+	first = src->hsize + src->sy;
+	if (src->hscrolled < first)
+		first -= src->hscrolled;
+	else
+		first = 0;
+	scrolled = (ny > first) ? ny - first : 0;
+	if (scrolled == ny)
+		pg->hscrolled += ny;
+	else
+		pg->hscrolled = scrolled;
+}
+
+/* Move the first ny lines of src to the top of the history. */
+static void
+grid_prepend_lines(struct grid *gd, struct grid *src, u_int ny)
+{
+	struct grid_line	*gl;
+	u_int			 yy, n;
+
+	grid_index_free(gd);
+
+	grid_grow_lines(gd, gd->hsize + gd->sy + ny);
+	gd->lineoff += gd->linesize - ny;
+	if (gd->lineoff >= gd->linesize)
+		gd->lineoff -= gd->linesize;
+
+	for (yy = 0; yy < ny; yy++) {
+		gl = grid_ring_line(gd, yy);
+		memcpy(gl, grid_ring_line(src, yy), sizeof *gl);
+		memset(grid_ring_line(src, yy), 0, sizeof *gl);
+		grid_count_line(gd, gl, 1);
+	}
+	gd->hsize += ny;
+
+	/* If the history is already being compressed, compress these too. */
+	if (gd->hfrozen != 0) {
+		for (yy = 0; yy < ny; yy += n) {
+			n = ny - yy;
+			if (n > GRID_BLOCK_LINES)
+				n = GRID_BLOCK_LINES;
+			grid_compress_lines(gd, yy, n);
+		}
+		gd->hfrozen += ny;
+	}
+
+	/* Older lines may now have been pushed far enough to go cold. */
+	grid_compress_history(gd);
+}
+
+/* Discard any history waiting to be reflowed. */
+static void
+grid_free_pending(struct grid *gd)
+{
+	if (gd->pending != NULL) {
+		grid_destroy(gd->pending);
+		gd->pending = NULL;
+	}
+}
+
+/*
+ * Reflow the next piece of any pending history and add it to the top of the
+ * history. Returns 1 if there is still more to do.
+ */
+int
+grid_reflow_pending(struct grid *gd)
+{
+	struct grid	*pg = gd->pending, *tmp;
+	u_int		 start, end, py, scrolled;
+	int		 all;
+
+	if (pg == NULL)
 		return (0);
-	return (sy - py);
+
+	end = pg->hsize;
+	start = (end > GRID_REFLOW_LINES) ? end - GRID_REFLOW_LINES : 0;
+	while (start > 0 &&
+	    grid_ring_line(pg, start - 1)->flags & GRID_LINE_WRAPPED)
+		start--;
+
+	/* Reflow into a grid without history so nothing is compressed. */
+	tmp = grid_create_shared(gd, gd->sx, 1);
+	tmp->flags &= ~GRID_HISTORY;
+	py = 0;
+	grid_reflow_lines(tmp, &py, pg, start, end, gd->sx);
+
+	if (pg->hscrolled >= end - start) {
+		scrolled = py;
+		pg->hscrolled -= end - start;
+	} else {
+		scrolled = (pg->hscrolled != 0) ? tmp->hscrolled : 0;
+		pg->hscrolled = 0;
+	}
+	pg->hsize = start;
+	if (pg->hfrozen > start)
+		pg->hfrozen = start;
+
+	all = (gd->hscrolled >= gd->hsize);
+	grid_prepend_lines(gd, tmp, py);
+	if (all)
+		gd->hscrolled += scrolled;
+	log_debug("%s: %u lines, %u left", __func__, py, start);
+
+	grid_destroy(tmp);
+	if (pg->hsize == 0)
+		grid_free_pending(gd);
+	return (gd->pending != NULL);
+}
+
+/* Reflow all of any pending history. */
+void
+grid_reflow_finish(struct grid *gd)
+{
+	while (grid_reflow_pending(gd))
+		/* nothing */;
+}
+
+/*
+ * Get the memory used by uncompressed and compressed history. The counts are
+ * kept up to date as lines enter and leave the history and as history lines
+ * grow, so this does not need to look at the lines.
+ */
+void
+grid_history_bytes(struct grid *gd, size_t *raw, size_t *compressed)
+{
+	size_t	pending_raw, pending_compressed;
+
+	*raw = gd->hsize * sizeof *gd->linedata;
+	*raw += gd->hcellbytes + gd->hextdbytes;
+	*compressed = gd->hcompressed;
+
+	if (gd->pending != NULL) {
+		grid_history_bytes(gd->pending, &pending_raw,
+		    &pending_compressed);
+		*raw += pending_raw;
+		*compressed += pending_compressed;
+	}
+}
+
+/*
+ * Change the history size, moving lines between the history and screen. Lines
+ * moved onto the screen are uncompressed and no longer count as frozen.
+ */
+void
+grid_set_hsize(struct grid *gd, u_int hsize)
+{
+	u_int	yy, old = gd->hsize;
+
+	if (hsize < gd->hsize)
+		grid_index_free(gd);
+	for (yy = hsize; yy < gd->hsize; yy++)
+		grid_count_line(gd, grid_ring_line(gd, yy), 0);
+	for (yy = gd->hsize; yy < hsize; yy++) {
+		grid_count_line(gd, grid_ring_line(gd, yy), 1);
+		grid_index_add(gd, yy);
+	}
+	gd->hsize = hsize;
+
+	if (gd->hfrozen > hsize)
+		gd->hfrozen = hsize;
+	for (yy = hsize; yy < old; yy++)
+		grid_get_line(gd, yy);
+}
+
+/*
+ * Compress a block of data. This is a simple LZ77 encoding: each sequence is
+ * a token byte with the number of literals in the top four bits and the match
+ * length less four in the bottom four (15 means more length bytes follow,
+ * each added until one is less than 255), then the literals, then a two byte
+ * offset back to the match. The last sequence has no match.
+ */
+static u_char *
+grid_block_compress(const u_char *in, size_t len, size_t *outlen)
+{
+	u_int		 table[4096], v, h;
+	size_t		 ip, ref, anchor, op, lit, mlen, n;
+	u_char		*out, *token;
+
+	out = xmalloc(len + len / 255 + 16);
+	memset(table, 0, sizeof table);
+
+	ip = anchor = op = 0;
+	for (;;) {
+		mlen = 0;
+		ref = 0;
+		while (ip + 4 <= len) {
+			memcpy(&v, in + ip, sizeof v);
+			h = (v * 2654435761U) >> 20;
+			ref = table[h];
+			table[h] = ip + 1;
+			if (ref != 0 && ip + 1 - ref <= 65535 &&
+			    memcmp(in + ref - 1, in + ip, 4) == 0) {
+				ref--;
+				mlen = 4;
+				while (ip + mlen < len &&
+				    in[ref + mlen] == in[ip + mlen])
+					mlen++;
+				break;
+			}
+			ip++;
+		}
+		if (mlen == 0)
+			ip = len;
+
+		token = &out[op++];
+		lit = ip - anchor;
+		*token = (lit >= 15 ? 15 : lit) << 4;
+		if (lit >= 15) {
+			for (n = lit - 15; n >= 255; n -= 255)
+				out[op++] = 255;
+			out[op++] = n;
+		}
+		memcpy(out + op, in + anchor, lit);
+		op += lit;
+		if (mlen == 0)
+			break;
+
+		out[op++] = (ip - ref) & 0xff;
+		out[op++] = (ip - ref) >> 8;
+		*token |= (mlen - 4 >= 15 ? 15 : mlen - 4);
+		if (mlen - 4 >= 15) {
+			for (n = mlen - 4 - 15; n >= 255; n -= 255)
+				out[op++] = 255;
+			out[op++] = n;
+		}
+		ip += mlen;
+		anchor = ip;
+	}
+
+	*outlen = op;
+	return (out);
+}
+
+/* Uncompress a block of data compressed with grid_block_compress. */
+static void
+grid_block_uncompress(const u_char *in, size_t len, u_char *out,
+    size_t outlen)
+{
+	size_t	ip, op, lit, mlen, off;
+	u_char	token, b;
+
+	ip = op = 0;
+	while (ip < len) {
+		token = in[ip++];
+
+		lit = token >> 4;
+		if (lit == 15) {
+			do {
+				if (ip >= len)
+					fatalx("bad compressed block");
+				b = in[ip++];
+				lit += b;
+			} while (b == 255);
+		}
+		if (lit > len - ip || lit > outlen - op)
+			fatalx("bad compressed block");
+		memcpy(out + op, in + ip, lit);
+		ip += lit;
+		op += lit;
+		if (ip == len)
+			break;
+
+		if (len - ip < 2)
+			fatalx("bad compressed block");
+		off = in[ip] | (in[ip + 1] << 8);
+		ip += 2;
+
+		mlen = (token & 15) + 4;
+		if ((token & 15) == 15) {
+			do {
+				if (ip >= len)
+					fatalx("bad compressed block");
+				b = in[ip++];
+				mlen += b;
+			} while (b == 255);
+		}
+		if (off == 0 || off > op || mlen > outlen - op)
+			fatalx("bad compressed block");
+		for (; mlen > 0; mlen--, op++)
+			out[op] = out[op - off];
+	}
+	if (op != outlen)
+		fatalx("bad compressed block");
+}
+
+/* Uncompress a block into the cache, replacing any block already there. */
+static void
+grid_block_cache(struct grid *gd, struct grid_block *gb)
+{
+	struct grid_block_header	 hdr;
+	struct grid_line		*gl;
+	u_char				*raw;
+	size_t				 off, size;
+	u_int				 i;
+
+	if (gd->hcached == gb)
+		return;
+	grid_block_uncache(gd);
+
+	raw = xmalloc(gb->rawsize);
+	grid_block_uncompress(gb->data, gb->size, raw, gb->rawsize);
+
+	gb->decoded = grid_alloc(gd, gb->lines * sizeof *gb->decoded);
+	memset(gb->decoded, 0, gb->lines * sizeof *gb->decoded);
+	off = 0;
+	for (i = 0; i < gb->lines; i++) {
+		gl = &gb->decoded[i];
+
+		memcpy(&hdr, raw + off, sizeof hdr);
+		off += sizeof hdr;
+		gl->cellused = hdr.cellused;
+		gl->cellsize = hdr.cellsize;
+		gl->cellstored = hdr.cellstored;
+		gl->extdsize = hdr.extdsize;
+		gl->flags = hdr.flags;
+		memcpy(&gl->fill, &hdr.fill, sizeof gl->fill);
+
+		if (gl->cellstored != 0) {
+			size = gl->cellstored * sizeof *gl->celldata;
+			gl->celldata = grid_alloc(gd, size);
+			memcpy(gl->celldata, raw + off, size);
+			off += size;
+		}
+		if (gl->extdsize != 0) {
+			size = gl->extdsize * sizeof *gl->extddata;
+			gl->extddata = grid_alloc(gd, size);
+			memcpy(gl->extddata, raw + off, size);
+			off += size;
+		}
+	}
+	free(raw);
+
+	gd->hcached = gb;
+}
+
+/* Free the cached uncompressed block. */
+static void
+grid_block_uncache(struct grid *gd)
+{
+	struct grid_block	*gb = gd->hcached;
+	u_int			 i;
+
+	if (gb == NULL)
+		return;
+	for (i = 0; i < gb->lines; i++) {
+		grid_free(gb->decoded[i].celldata);
+		grid_free(gb->decoded[i].extddata);
+	}
+#ifdef DEBUG
+	/* Make sure a line still held from the cache is not used quietly. */
+	memset(gb->decoded, 0xdb, gb->lines * sizeof *gb->decoded);
+#endif
+	grid_free(gb->decoded);
+	gb->decoded = NULL;
+
+	gd->hcached = NULL;
+}
+
+/* Drop a reference to a block, freeing it when no lines are left. */
+static void
+grid_block_release(struct grid *gd, struct grid_block *gb)
+{
+	if (--gb->references != 0)
+		return;
+
+	if (gd->hcached == gb)
+		grid_block_uncache(gd);
+	gd->hcompressed -= sizeof *gb + gb->size;
+
+	grid_free(gb->data);
+	grid_free(gb);
+}
+
+/* Compress any uncompressed lines in a range into a new block. */
+static void
+grid_compress_lines(struct grid *gd, u_int py, u_int ny)
+{
+	struct grid_block_header	 hdr;
+	struct grid_block		*gb;
+	struct grid_line		*gl;
+	u_char				*raw, *data;
+	size_t				 rawsize, off, size;
+	u_int				 yy, lines;
+
+	rawsize = 0;
+	lines = 0;
+	for (yy = py; yy < py + ny; yy++) {
+		gl = grid_ring_line(gd, yy);
+		if (gl->flags & GRID_LINE_COMPRESSED)
+			continue;
+		rawsize += sizeof hdr;
+		rawsize += gl->cellstored * sizeof *gl->celldata;
+		rawsize += gl->extdsize * sizeof *gl->extddata;
+		lines++;
+	}
+	if (lines == 0)
+		return;
+
+	gb = grid_alloc(gd, sizeof *gb);
+	memset(gb, 0, sizeof *gb);
+	gb->rawsize = rawsize;
+	gb->lines = gb->references = lines;
+
+	raw = xmalloc(rawsize);
+	off = 0;
+	lines = 0;
+	for (yy = py; yy < py + ny; yy++) {
+		gl = grid_ring_line(gd, yy);
+		if (gl->flags & GRID_LINE_COMPRESSED)
+			continue;
+
+		hdr.cellused = gl->cellused;
+		hdr.cellsize = gl->cellsize;
+		hdr.cellstored = gl->cellstored;
+		hdr.extdsize = gl->extdsize;
+		hdr.flags = gl->flags;
+		memcpy(&hdr.fill, &gl->fill, sizeof hdr.fill);
+		memcpy(raw + off, &hdr, sizeof hdr);
+		off += sizeof hdr;
+
+		size = gl->cellstored * sizeof *gl->celldata;
+		if (size != 0)
+			memcpy(raw + off, gl->celldata, size);
+		off += size;
+		size = gl->extdsize * sizeof *gl->extddata;
+		if (size != 0)
+			memcpy(raw + off, gl->extddata, size);
+		off += size;
+
+		if (yy < gd->hsize)
+			grid_count_line(gd, gl, 0);
+		grid_free(gl->celldata);
+		grid_free(gl->extddata);
+		gl->extddata = NULL;
+
+		gl->block = gb;
+		gl->blockline = lines++;
+		gl->flags |= GRID_LINE_COMPRESSED;
+	}
+
+	data = grid_block_compress(raw, rawsize, &gb->size);
+	free(raw);
+	gb->data = grid_alloc(gd, gb->size);
+	memcpy(gb->data, data, gb->size);
+	free(data);
+
+	gd->hcompressed += sizeof *gb + gb->size;
+}
+
+/* Compress all of the history, not only lines which have gone cold. */
+void
+grid_compress_all_history(struct grid *gd)
+{
+	u_int	ny;
+
+	if (gd->pending != NULL)
+		grid_compress_all_history(gd->pending);
+	while (gd->hfrozen < gd->hsize) {
+		ny = gd->hsize - gd->hfrozen;
+		if (ny > GRID_BLOCK_LINES)
+			ny = GRID_BLOCK_LINES;
+		grid_compress_lines(gd, gd->hfrozen, ny);
+		gd->hfrozen += ny;
+	}
+}
+
+/* Compress any blocks of history which have scrolled far enough. */
+static void
+grid_compress_history(struct grid *gd)
+{
+	if (~gd->flags & GRID_HISTORY)
+		return;
+	while (gd->hsize >= gd->hfrozen + GRID_COLD_LINES + GRID_BLOCK_LINES) {
+		grid_compress_lines(gd, gd->hfrozen, GRID_BLOCK_LINES);
+		gd->hfrozen += GRID_BLOCK_LINES;
+	}
 }
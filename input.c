@@ -110,6 +110,9 @@ static void printflike(2, 3) input_reply(struct input_ctx *, const char *, ...);
 static void	input_set_state(struct window_pane *,
 		    const struct input_transition *);
 static void	input_reset_cell(struct input_ctx *);
+static size_t	input_print_length(const u_char *, size_t);
+static void	input_print_span(struct input_ctx *, const u_char *, size_t);
+static size_t	input_utf8_span(struct input_ctx *, const u_char *, size_t);
 
 static void	input_osc_4(struct window_pane *, const char *);
 static void	input_osc_10(struct window_pane *, const char *);
@@ -285,6 +288,9 @@ struct input_state {
 	void				(*enter)(struct input_ctx *);
 	void				(*exit)(struct input_ctx *);
 	const struct input_transition	*transitions;
+
+	/* Transition for each byte, built from transitions on first use. */
+	const struct input_transition	*lookup[256];
 };
 
 /* State transitions available from all states. */
@@ -316,143 +322,187 @@ static const struct input_transition input_state_utf8_two_table[];
 static const struct input_transition input_state_utf8_one_table[];
 
 /* ground state definition. */
-static const struct input_state input_state_ground = {
+static struct input_state input_state_ground = {
 	"ground",
 	input_ground, NULL,
-	input_state_ground_table
+	input_state_ground_table,
+	{ NULL }
 };
 
 /* esc_enter state definition. */
-static const struct input_state input_state_esc_enter = {
+static struct input_state input_state_esc_enter = {
 	"esc_enter",
 	input_clear, NULL,
-	input_state_esc_enter_table
+	input_state_esc_enter_table,
+	{ NULL }
 };
 
 /* esc_intermediate state definition. */
-static const struct input_state input_state_esc_intermediate = {
+static struct input_state input_state_esc_intermediate = {
 	"esc_intermediate",
 	NULL, NULL,
-	input_state_esc_intermediate_table
+	input_state_esc_intermediate_table,
+	{ NULL }
 };
 
 /* csi_enter state definition. */
-static const struct input_state input_state_csi_enter = {
+static struct input_state input_state_csi_enter = {
 	"csi_enter",
 	input_clear, NULL,
-	input_state_csi_enter_table
+	input_state_csi_enter_table,
+	{ NULL }
 };
 
 /* csi_parameter state definition. */
-static const struct input_state input_state_csi_parameter = {
+static struct input_state input_state_csi_parameter = {
 	"csi_parameter",
 	NULL, NULL,
-	input_state_csi_parameter_table
+	input_state_csi_parameter_table,
+	{ NULL }
 };
 
 /* csi_intermediate state definition. */
-static const struct input_state input_state_csi_intermediate = {
+static struct input_state input_state_csi_intermediate = {
 	"csi_intermediate",
 	NULL, NULL,
-	input_state_csi_intermediate_table
+	input_state_csi_intermediate_table,
+	{ NULL }
 };
 
 /* csi_ignore state definition. */
-static const struct input_state input_state_csi_ignore = {
+static struct input_state input_state_csi_ignore = {
 	"csi_ignore",
 	NULL, NULL,
-	input_state_csi_ignore_table
+	input_state_csi_ignore_table,
+	{ NULL }
 };
 
 /* dcs_enter state definition. */
-static const struct input_state input_state_dcs_enter = {
+static struct input_state input_state_dcs_enter = {
 	"dcs_enter",
 	input_enter_dcs, NULL,
-	input_state_dcs_enter_table
+	input_state_dcs_enter_table,
+	{ NULL }
 };
 
 /* dcs_parameter state definition. */
-static const struct input_state input_state_dcs_parameter = {
+static struct input_state input_state_dcs_parameter = {
 	"dcs_parameter",
 	NULL, NULL,
-	input_state_dcs_parameter_table
+	input_state_dcs_parameter_table,
+	{ NULL }
 };
 
 /* dcs_intermediate state definition. */
-static const struct input_state input_state_dcs_intermediate = {
+static struct input_state input_state_dcs_intermediate = {
 	"dcs_intermediate",
 	NULL, NULL,
-	input_state_dcs_intermediate_table
+	input_state_dcs_intermediate_table,
+	{ NULL }
 };
 
 /* dcs_handler state definition. */
-static const struct input_state input_state_dcs_handler = {
+static struct input_state input_state_dcs_handler = {
 	"dcs_handler",
 	NULL, NULL,
-	input_state_dcs_handler_table
+	input_state_dcs_handler_table,
+	{ NULL }
 };
 
 /* dcs_escape state definition. */
-static const struct input_state input_state_dcs_escape = {
+static struct input_state input_state_dcs_escape = {
 	"dcs_escape",
 	NULL, NULL,
-	input_state_dcs_escape_table
+	input_state_dcs_escape_table,
+	{ NULL }
 };
 
 /* dcs_ignore state definition. */
-static const struct input_state input_state_dcs_ignore = {
+static struct input_state input_state_dcs_ignore = {
 	"dcs_ignore",
 	NULL, NULL,
-	input_state_dcs_ignore_table
+	input_state_dcs_ignore_table,
+	{ NULL }
 };
 
 /* osc_string state definition. */
-static const struct input_state input_state_osc_string = {
+static struct input_state input_state_osc_string = {
 	"osc_string",
 	input_enter_osc, input_exit_osc,
-	input_state_osc_string_table
+	input_state_osc_string_table,
+	{ NULL }
 };
 
 /* apc_string state definition. */
-static const struct input_state input_state_apc_string = {
+static struct input_state input_state_apc_string = {
 	"apc_string",
 	input_enter_apc, input_exit_apc,
-	input_state_apc_string_table
+	input_state_apc_string_table,
+	{ NULL }
 };
 
 /* rename_string state definition. */
-static const struct input_state input_state_rename_string = {
+static struct input_state input_state_rename_string = {
 	"rename_string",
 	input_enter_rename, input_exit_rename,
-	input_state_rename_string_table
+	input_state_rename_string_table,
+	{ NULL }
 };
 
 /* consume_st state definition. */
-static const struct input_state input_state_consume_st = {
+static struct input_state input_state_consume_st = {
 	"consume_st",
 	NULL, NULL,
-	input_state_consume_st_table
+	input_state_consume_st_table,
+	{ NULL }
 };
 
 /* utf8_three state definition. */
-static const struct input_state input_state_utf8_three = {
+static struct input_state input_state_utf8_three = {
 	"utf8_three",
 	NULL, NULL,
-	input_state_utf8_three_table
+	input_state_utf8_three_table,
+	{ NULL }
 };
 
 /* utf8_two state definition. */
-static const struct input_state input_state_utf8_two = {
+static struct input_state input_state_utf8_two = {
 	"utf8_two",
 	NULL, NULL,
-	input_state_utf8_two_table
+	input_state_utf8_two_table,
+	{ NULL }
 };
 
 /* utf8_one state definition. */
-static const struct input_state input_state_utf8_one = {
+static struct input_state input_state_utf8_one = {
 	"utf8_one",
 	NULL, NULL,
-	input_state_utf8_one_table
+	input_state_utf8_one_table,
+	{ NULL }
+};
+
+/* All states, for building the lookup tables. */
+static struct input_state *input_states[] = {
+	&input_state_ground,
+	&input_state_esc_enter,
+	&input_state_esc_intermediate,
+	&input_state_csi_enter,
+	&input_state_csi_parameter,
+	&input_state_csi_intermediate,
+	&input_state_csi_ignore,
+	&input_state_dcs_enter,
+	&input_state_dcs_parameter,
+	&input_state_dcs_intermediate,
+	&input_state_dcs_handler,
+	&input_state_dcs_escape,
+	&input_state_dcs_ignore,
+	&input_state_osc_string,
+	&input_state_apc_string,
+	&input_state_rename_string,
+	&input_state_consume_st,
+	&input_state_utf8_three,
+	&input_state_utf8_two,
+	&input_state_utf8_one
 };
 
 /* ground state table. */
@@ -796,12 +846,49 @@ input_reset_cell(struct input_ctx *ictx)
 	ictx->old_cy = 0;
 }
 
+/*
+ * Build the lookup table for each state, so the transition for a byte can be
+ * found without searching the list.
+ */
+static void
+input_build_lookup(void)
+{
+	static int			 built;
+	struct input_state		*is;
+	const struct input_transition	*itr;
+	u_int				 i, ch;
+
+	if (built)
+		return;
+	built = 1;
+
+	for (i = 0; i < nitems(input_states); i++) {
+		is = input_states[i];
+		for (ch = 0; ch < nitems(is->lookup); ch++) {
+			itr = is->transitions;
+			while (itr->first != -1 && itr->last != -1) {
+				if ((int)ch >= itr->first &&
+				    (int)ch <= itr->last)
+					break;
+				itr++;
+			}
+			if (itr->first == -1 || itr->last == -1) {
+				/* No transition? Eh? */
+				fatalx("no transition from state %s", is->name);
+			}
+			is->lookup[ch] = itr;
+		}
+	}
+}
+
 /* Initialise input parser. */
 void
 input_init(struct window_pane *wp)
 {
 	struct input_ctx	*ictx;
 
+	input_build_lookup();
+
 	ictx = wp->ictx = xcalloc(1, sizeof *ictx);
 
 	ictx->input_space = INPUT_BUF_START;
@@ -880,12 +967,14 @@ input_parse(struct window_pane *wp)
 	const struct input_transition	*itr;
 	struct evbuffer			*evb = wp->event->input;
 	u_char				*buf;
-	size_t				 len, off;
+	size_t				 len, off, n;
 
 	if (EVBUFFER_LENGTH(evb) == 0)
 		return;
 
 	window_update_activity(wp->window);
+	memcpy(&wp->used_time, &wp->window->activity_time,
+	    sizeof wp->used_time);
 	wp->flags |= PANE_CHANGED;
 
 	/*
@@ -909,19 +998,27 @@ input_parse(struct window_pane *wp)
 
 	/* Parse the input. */
 	while (off < len) {
+		/*
+		 * Printable ASCII and complete UTF-8 characters in the ground
+		 * state go straight to the screen, so write as much as
+		 * possible together.
+		 */
+		if (ictx->state == &input_state_ground) {
+			n = input_print_length(buf + off, len - off);
+			if (n != 0)
+				input_print_span(ictx, buf + off, n);
+			else
+				n = input_utf8_span(ictx, buf + off, len - off);
+			if (n != 0) {
+				off += n;
+				continue;
+			}
+		}
+
 		ictx->ch = buf[off++];
 
 		/* Find the transition. */
-		itr = ictx->state->transitions;
-		while (itr->first != -1 && itr->last != -1) {
-			if (ictx->ch >= itr->first && ictx->ch <= itr->last)
-				break;
-			itr++;
-		}
-		if (itr->first == -1 || itr->last == -1) {
-			/* No transition? Eh? */
-			fatalx("no transition from state");
-		}
+		itr = ictx->state->lookup[ictx->ch];
 
 		/*
 		 * Any state except print stops the current collection. This is
@@ -1068,6 +1165,49 @@ input_print(struct input_ctx *ictx)
 	return (0);
 }
 
+/*
+ * Return the number of printable ASCII characters (0x20 to 0x7e) at the start
+ * of a buffer. Eight bytes are checked at a time while possible.
+ */
+static size_t
+input_print_length(const u_char *buf, size_t len)
+{
+	const uint64_t	 ones = 0x0101010101010101ULL;
+	const uint64_t	 highs = 0x8080808080808080ULL;
+	uint64_t	 word;
+	size_t		 n = 0;
+
+	while (len - n >= sizeof word) {
+		memcpy(&word, buf + n, sizeof word);
+
+		/* Stop if any byte is below 0x20 or above 0x7e. */
+		if (((word - 0x20 * ones) | (word + ones) | word) & highs)
+			break;
+		n += sizeof word;
+	}
+	while (n < len && buf[n] >= 0x20 && buf[n] <= 0x7e)
+		n++;
+	return (n);
+}
+
+/* Output a run of printable ASCII characters to the screen. */
+static void
+input_print_span(struct input_ctx *ictx, const u_char *buf, size_t len)
+{
+	int	set;
+
+	set = ictx->cell.set == 0 ? ictx->cell.g0set : ictx->cell.g1set;
+	if (set == 1)
+		ictx->cell.cell.attr |= GRID_ATTR_CHARSET;
+	else
+		ictx->cell.cell.attr &= ~GRID_ATTR_CHARSET;
+
+	screen_write_collect_span(&ictx->ctx, &ictx->cell.cell, buf, len);
+	utf8_set(&ictx->cell.cell.data, buf[len - 1]);
+
+	ictx->cell.cell.attr &= ~GRID_ATTR_CHARSET;
+}
+
 /* Collect intermediate string. */
 static int
 input_intermediate(struct input_ctx *ictx)
@@ -2071,6 +2211,33 @@ input_utf8_close(struct input_ctx *ictx)
 	return (0);
 }
 
+/*
+ * Output a run of complete UTF-8 characters. Returns the number of bytes used,
+ * zero if the buffer does not start with a complete character (so it must go
+ * through the UTF-8 states instead).
+ */
+static size_t
+input_utf8_span(struct input_ctx *ictx, const u_char *buf, size_t len)
+{
+	struct utf8_data	*ud = &ictx->utf8data;
+	enum utf8_state		 more;
+	size_t			 n = 0;
+
+	while (n < len && buf[n] > 0x7f) {
+		more = utf8_decode(ud, buf + n, len - n);
+		if (more == UTF8_MORE)
+			break;
+		n += ud->size;
+
+		/* As for input_utf8_close, drop characters with no width. */
+		if (more == UTF8_DONE) {
+			utf8_copy(&ictx->cell.cell.data, ud);
+			screen_write_collect_add(&ictx->ctx, &ictx->cell.cell);
+		}
+	}
+	return (n);
+}
+
 /* Handle the OSC 4 sequence for setting (multiple) palette entries. */
 static void
 input_osc_4(struct window_pane *wp, const char *p)
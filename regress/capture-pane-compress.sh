@@ -0,0 +1,68 @@
+#!/bin/sh
+
+# capture-pane should show the same history once it has been compressed and
+# after the pane has been resized
+
+PATH=/bin:/usr/bin
+TERM=screen
+
+[ -z "$TEST_TMUX" ] && TEST_TMUX=$(readlink -f ../tmux)
+TMUX="$TEST_TMUX -Ltest"
+$TMUX kill-server 2>/dev/null
+
+TMP1=$(mktemp)
+TMP2=$(mktemp)
+TMP3=$(mktemp)
+trap "rm -f $TMP1 $TMP2 $TMP3" 0 1 15
+
+# More lines than GRID_COLD_LINES and GRID_BLOCK_LINES together, all on the
+# screen to start with so none are compressed.
+$TMUX -f/dev/null new -d -x80 -y1600 "
+	i=0
+	while [ \$i -lt 1500 ]; do
+		printf '\033[1;3%dm%d \033[4;38;5;%dma\033[7;48;2;1;2;%dmb' \
+			\$((i % 8)) \$i \$((i % 256)) \$((i % 256))
+		printf '\033[0;2mc\033[m\n'
+		i=\$((i + 1))
+	done
+	$TMUX wait -S printed
+	$TMUX wait more
+	echo end
+	$TMUX wait -S ended
+	sleep 30
+" || exit 1
+$TMUX wait printed
+
+# The signal can arrive before tmux has parsed everything before it, so wait
+# for the last line to appear.
+n=0
+until $TMUX capturep -p |grep -q '^1499 '; do
+	n=$((n + 1))
+	[ $n -gt 30 ] && exit 1
+	sleep 1
+done
+$TMUX capturep -epS- |grep -v '^$' >$TMP1
+echo end >>$TMP1
+
+# Shrink the pane so the lines move into the history, then write another so
+# it scrolls and the oldest lines are compressed.
+$TMUX splitw -dv -l1590 "sleep 30" || exit 1
+$TMUX wait -S more
+$TMUX wait ended
+n=0
+until $TMUX capturep -pt0 |grep -q '^end$' &&
+    [ "$($TMUX display -pt0 '#{history_compressed_bytes}')" -gt 0 ]; do
+	n=$((n + 1))
+	[ $n -gt 30 ] && exit 1
+	sleep 1
+done
+$TMUX capturep -t0 -epS- |grep -v '^$' >$TMP2
+cmp $TMP1 $TMP2 || exit 1
+
+# Make the pane narrower so the history is reflowed.
+$TMUX splitw -dh -t0 -l30 "sleep 30" || exit 1
+$TMUX capturep -t0 -epS- |grep -v '^$' >$TMP3
+cmp $TMP1 $TMP3 || exit 1
+
+$TMUX kill-server 2>/dev/null
+exit 0
@@ -0,0 +1,41 @@
+#!/bin/sh
+
+# history waiting to be reflowed should be finished after leaving a mode
+
+PATH=/bin:/usr/bin
+TERM=screen
+
+[ -z "$TEST_TMUX" ] && TEST_TMUX=$(readlink -f ../tmux)
+TMUX="$TEST_TMUX -Ltest"
+$TMUX kill-server 2>/dev/null
+
+# Lines of 60 characters, which wrap into two when the pane is narrowed.
+$TMUX -f/dev/null start\; set -g history-limit 100000\; new -d -x80 -y24 "
+	i=0
+	while [ \$i -lt 40000 ]; do
+		printf '%05d %054d\n' \$i 0
+		i=\$((i + 1))
+	done
+	sleep 30
+" || exit 1
+n=0
+until $TMUX capturep -p |grep -q '^39999 '; do
+	n=$((n + 1))
+	[ $n -gt 30 ] && exit 1
+	sleep 1
+done
+
+# Narrow the pane and enter a mode before the history has been reflowed, then
+# leave the mode.
+$TMUX splitw -dh -l42 "sleep 30"\; clock-mode -t0 || exit 1
+$TMUX send -t0 q || exit 1
+n=0
+until [ "$($TMUX display -pt0 '#{pane_in_mode} #{history_size}')" \
+    = "0 79977" ]; do
+	n=$((n + 1))
+	[ $n -gt 10 ] && exit 1
+	sleep 1
+done
+
+$TMUX kill-server 2>/dev/null
+exit 0
@@ -29,6 +29,8 @@ static void	screen_write_collect_clear(struct screen_write_ctx *, u_int,
 		    u_int);
 static void	screen_write_collect_scroll(struct screen_write_ctx *);
 static void	screen_write_collect_flush(struct screen_write_ctx *, int);
+static struct screen_write_collect_item *screen_write_get_item(void);
+static void	screen_write_free_item(struct screen_write_collect_item *);
 
 static int	screen_write_overwrite(struct screen_write_ctx *,
 		    struct grid_cell *, u_int);
@@ -44,6 +46,8 @@ struct screen_write_collect_item {
 	int			 wrapped;
 
 	u_int			 used;
+	u_int			 width;
+	int			 utf8;
 	char			 data[256];
 
 	struct grid_cell	 gc;
@@ -54,6 +58,47 @@ struct screen_write_collect_line {
 	TAILQ_HEAD(, screen_write_collect_item) items;
 };
 
+/*
+ * Collect items are kept for reuse rather than freed, up to a limit. The
+ * lines are kept in the screen until it is resized.
+ */
+#define SCREEN_WRITE_FREE_ITEMS 1024
+static TAILQ_HEAD(, screen_write_collect_item) screen_write_free_list =
+    TAILQ_HEAD_INITIALIZER(screen_write_free_list);
+static u_int	screen_write_free_count;
+
+/* Get a collect item, from the free list if possible. */
+static struct screen_write_collect_item *
+screen_write_get_item(void)
+{
+	struct screen_write_collect_item	*ci;
+
+	ci = TAILQ_FIRST(&screen_write_free_list);
+	if (ci == NULL)
+		return (xcalloc(1, sizeof *ci));
+	TAILQ_REMOVE(&screen_write_free_list, ci, entry);
+	screen_write_free_count--;
+
+	ci->x = 0;
+	ci->wrapped = 0;
+	ci->used = 0;
+	ci->width = 0;
+	ci->utf8 = 0;
+	return (ci);
+}
+
+/* Put a collect item on the free list, or free it if there are enough. */
+static void
+screen_write_free_item(struct screen_write_collect_item *ci)
+{
+	if (screen_write_free_count == SCREEN_WRITE_FREE_ITEMS) {
+		free(ci);
+		return;
+	}
+	TAILQ_INSERT_HEAD(&screen_write_free_list, ci, entry);
+	screen_write_free_count++;
+}
+
 /* Initialize writing with a window. */
 void
 screen_write_start(struct screen_write_ctx *ctx, struct window_pane *wp,
@@ -70,10 +115,19 @@ screen_write_start(struct screen_write_ctx *ctx, struct window_pane *wp,
 	else
 		ctx->s = s;
 
-	ctx->list = xcalloc(screen_size_y(ctx->s), sizeof *ctx->list);
-	for (y = 0; y < screen_size_y(ctx->s); y++)
-		TAILQ_INIT(&ctx->list[y].items);
-	ctx->item = xcalloc(1, sizeof *ctx->item);
+	/*
+	 * Take the lines from the screen if it has them; they are given back
+	 * when finished. If they are already in use, make a new set.
+	 */
+	if (ctx->s->write_list != NULL) {
+		ctx->list = ctx->s->write_list;
+		ctx->s->write_list = NULL;
+	} else {
+		ctx->list = xcalloc(screen_size_y(ctx->s), sizeof *ctx->list);
+		for (y = 0; y < screen_size_y(ctx->s); y++)
+			TAILQ_INIT(&ctx->list[y].items);
+	}
+	ctx->item = screen_write_get_item();
 
 	ctx->scrolled = 0;
 	ctx->bg = 8;
@@ -94,8 +148,13 @@ screen_write_stop(struct screen_write_ctx *ctx)
 	log_debug("%s: %u cells (%u written, %u skipped)", __func__,
 	    ctx->cells, ctx->written, ctx->skipped);
 
-	free(ctx->item);
-	free(ctx->list); /* flush will have emptied */
+	screen_write_free_item(ctx->item);
+
+	/* Flush will have emptied the lines. */
+	if (ctx->s->write_list == NULL)
+		ctx->s->write_list = ctx->list;
+	else
+		free(ctx->list);
 }
 
 /* Reset screen state. */
@@ -658,7 +717,7 @@ screen_write_backspace(struct screen_write_ctx *ctx)
 	if (s->cx == 0) {
 		if (s->cy == 0)
 			return;
-		gl = &s->grid->linedata[s->grid->hsize + s->cy - 1];
+		gl = grid_get_line(s->grid, s->grid->hsize + s->cy - 1);
 		if (gl->flags & GRID_LINE_WRAPPED) {
 			s->cy--;
 			s->cx = screen_size_x(s) - 1;
@@ -881,7 +940,7 @@ screen_write_clearline(struct screen_write_ctx *ctx, u_int bg)
 	struct tty_ctx		 ttyctx;
 	u_int			 sx = screen_size_x(s);
 
-	gl = &s->grid->linedata[s->grid->hsize + s->cy];
+	gl = grid_get_line(s->grid, s->grid->hsize + s->cy);
 	if (gl->cellsize == 0 && bg == 8)
 		return;
 
@@ -904,7 +963,7 @@ screen_write_clearendofline(struct screen_write_ctx *ctx, u_int bg)
 	struct tty_ctx		 ttyctx;
 	u_int			 sx = screen_size_x(s);
 
-	gl = &s->grid->linedata[s->grid->hsize + s->cy];
+	gl = grid_get_line(s->grid, s->grid->hsize + s->cy);
 	if (s->cx > sx - 1 || (s->cx >= gl->cellsize && bg == 8))
 		return;
 
@@ -1007,7 +1066,7 @@ screen_write_linefeed(struct screen_write_ctx *ctx, int wrapped, u_int bg)
 	struct grid		*gd = s->grid;
 	struct grid_line	*gl;
 
-	gl = &gd->linedata[gd->hsize + s->cy];
+	gl = grid_get_line(gd, gd->hsize + s->cy);
 	if (wrapped)
 		gl->flags |= GRID_LINE_WRAPPED;
 	else
@@ -1137,11 +1196,7 @@ screen_write_clearscreen(struct screen_write_ctx *ctx, u_int bg)
 void
 screen_write_clearhistory(struct screen_write_ctx *ctx)
 {
-	struct screen	*s = ctx->s;
-	struct grid	*gd = s->grid;
-
-	grid_move_lines(gd, 0, gd->hsize, gd->sy, 8);
-	gd->hscrolled = gd->hsize = 0;
+	grid_clear_history(ctx->s->grid);
 }
 
 /* Clear a collected line. */
@@ -1159,7 +1214,7 @@ screen_write_collect_clear(struct screen_write_ctx *ctx, u_int y, u_int n)
 		TAILQ_FOREACH_SAFE(ci, &ctx->list[i].items, entry, tmp) {
 			size += ci->used;
 			TAILQ_REMOVE(&ctx->list[i].items, ci, entry);
-			free(ci);
+			screen_write_free_item(ci);
 		}
 		ctx->skipped += size;
 		log_debug("%s: dropped %zu bytes (line %u)", __func__, size, i);
@@ -1227,7 +1282,7 @@ screen_write_collect_flush(struct screen_write_ctx *ctx, int scroll_only)
 			written += ci->used;
 
 			TAILQ_REMOVE(&ctx->list[y].items, ci, entry);
-			free(ci);
+			screen_write_free_item(ci);
 		}
 	}
 	s->cx = cx; s->cy = cy;
@@ -1243,6 +1298,7 @@ screen_write_collect_end(struct screen_write_ctx *ctx)
 	struct screen				*s = ctx->s;
 	struct screen_write_collect_item	*ci = ctx->item;
 	struct grid_cell			 gc;
+	u_int					 i, x, xx;
 
 	if (ci->used == 0)
 		return;
@@ -1250,14 +1306,135 @@ screen_write_collect_end(struct screen_write_ctx *ctx)
 
 	ci->x = s->cx;
 	TAILQ_INSERT_TAIL(&ctx->list[s->cy].items, ci, entry);
-	ctx->item = xcalloc(1, sizeof *ctx->item);
+	ctx->item = screen_write_get_item();
 
 	log_debug("%s: %u %s (at %u,%u)", __func__, ci->used, ci->data, s->cx,
 	    s->cy);
 
 	memcpy(&gc, &ci->gc, sizeof gc);
-	grid_view_set_cells(s->grid, s->cx, s->cy, &gc, ci->data, ci->used);
-	s->cx += ci->used;
+	if (!ci->utf8) {
+		grid_view_set_cells(s->grid, s->cx, s->cy, &gc, ci->data,
+		    ci->used);
+		s->cx += ci->used;
+		return;
+	}
+
+	/*
+	 * Set each character in turn, with padding after wide characters.
+	 * Only well-formed UTF-8 is collected so it can be decoded again here.
+	 */
+	x = s->cx;
+	for (i = 0; i < ci->used; i += gc.data.size) {
+		if ((u_char)ci->data[i] <= 0x7f)
+			utf8_set(&gc.data, ci->data[i]);
+		else
+			utf8_decode(&gc.data, ci->data + i, ci->used - i);
+		grid_view_set_cell(s->grid, x, s->cy, &gc);
+		for (xx = x + 1; xx < x + gc.data.width; xx++) {
+			grid_view_set_cell(s->grid, xx, s->cy,
+			    &screen_write_pad_cell);
+		}
+		x += gc.data.width;
+	}
+	s->cx += ci->width;
+}
+
+/*
+ * Check if a UTF-8 character can be collected at a position: it must not
+ * overwrite part of an existing wide character, since that needs the
+ * handling in screen_write_cell.
+ */
+static int
+screen_write_collect_fits(struct screen_write_ctx *ctx,
+    const struct grid_cell *gc, u_int x)
+{
+	struct screen		*s = ctx->s;
+	struct grid_line	*gl;
+	struct grid_cell	 now_gc;
+	struct utf8_data	 ud;
+
+	if (utf8_decode(&ud, gc->data.data, gc->data.size) != UTF8_DONE ||
+	    ud.size != gc->data.size ||
+	    ud.width != gc->data.width)
+		return (0);
+
+	gl = grid_get_line(s->grid, s->grid->hsize + s->cy);
+	if (~gl->flags & GRID_LINE_EXTENDED)
+		return (1);
+
+	grid_view_get_cell(s->grid, x, s->cy, &now_gc);
+	if ((now_gc.flags & GRID_FLAG_PADDING) || now_gc.data.width != 1)
+		return (0);
+	if (x + gc->data.width < screen_size_x(s)) {
+		grid_view_get_cell(s->grid, x + gc->data.width, s->cy, &now_gc);
+		if (now_gc.flags & GRID_FLAG_PADDING)
+			return (0);
+	}
+	return (1);
+}
+
+/*
+ * Write a run of printable ASCII characters with the same attributes. This
+ * is the same as calling screen_write_collect_add for each character, but
+ * copies as much as fits on the line at once.
+ */
+void
+screen_write_collect_span(struct screen_write_ctx *ctx,
+    const struct grid_cell *gc, const u_char *buf, u_int len)
+{
+	struct screen				*s = ctx->s;
+	struct screen_write_collect_item	*ci;
+	struct grid_cell			 tmp_gc;
+	u_int					 sx = screen_size_x(s), n;
+
+	if ((gc->attr & GRID_ATTR_CHARSET) ||
+	    (~s->mode & MODE_WRAP) ||
+	    (s->mode & MODE_INSERT) ||
+	    s->sel.flag) {
+		memcpy(&tmp_gc, gc, sizeof tmp_gc);
+		for (n = 0; n < len; n++) {
+			utf8_set(&tmp_gc.data, buf[n]);
+			screen_write_collect_add(ctx, &tmp_gc);
+		}
+		return;
+	}
+	ctx->cells += len;
+
+	while (len != 0) {
+		if (s->cx > sx - 1 ||
+		    ctx->item->width > sx - 1 - s->cx ||
+		    ctx->item->used == (sizeof ctx->item->data) - 1)
+			screen_write_collect_end(ctx);
+		ci = ctx->item; /* may have changed */
+
+		if (s->cx > sx - 1) {
+			log_debug("%s: wrapped at %u,%u", __func__, s->cx,
+			    s->cy);
+			ci->wrapped = 1;
+			screen_write_linefeed(ctx, 1, 8);
+			s->cx = 0;
+		}
+
+		if (ci->used == 0) {
+			memcpy(&ci->gc, gc, sizeof ci->gc);
+			utf8_set(&ci->gc.data, *buf);
+		}
+
+		/* Copy up to the end of the line or item, whichever first. */
+		n = sx - s->cx - ci->width;
+		if (n > (sizeof ci->data) - 1 - ci->used)
+			n = (sizeof ci->data) - 1 - ci->used;
+		if (n > len)
+			n = len;
+		memcpy(ci->data + ci->used, buf, n);
+		ci->used += n;
+		ci->width += n;
+		buf += n;
+		len -= n;
+
+		if (ci->used == (sizeof ci->data) - 1)
+			screen_write_collect_end(ctx);
+	}
 }
 
 /* Write cell data, collecting if necessary. */
@@ -1269,16 +1446,20 @@ screen_write_collect_add(struct screen_write_ctx *ctx,
 	struct screen_write_collect_item	*ci;
 	u_int					 sx = screen_size_x(s);
 	int					 collect;
+	u_int					 width = gc->data.width;
+	u_int					 size = gc->data.size;
 
 	/*
 	 * Don't need to check that the attributes and whatnot are still the
 	 * same - input_parse will end the collection when anything that isn't
 	 * a plain character is encountered. Also nothing should make it here
-	 * that isn't a single ASCII character.
+	 * that isn't a single ASCII or complete UTF-8 character.
 	 */
 
 	collect = 1;
-	if (gc->data.width != 1 || gc->data.size != 1)
+	if (width == 0 || width > 2 || width > sx)
+		collect = 0;
+	else if (size == 1 && width != 1)
 		collect = 0;
 	else if (gc->attr & GRID_ATTR_CHARSET)
 		collect = 0;
@@ -1294,22 +1475,36 @@ screen_write_collect_add(struct screen_write_ctx *ctx,
 		screen_write_cell(ctx, gc);
 		return;
 	}
-	ctx->cells++;
 
-	if (s->cx > sx - 1 || ctx->item->used > sx - 1 - s->cx)
+	if (s->cx > sx - width ||
+	    ctx->item->width > sx - width - s->cx ||
+	    ctx->item->used + size > (sizeof ctx->item->data) - 1)
 		screen_write_collect_end(ctx);
 	ci = ctx->item; /* may have changed */
 
-	if (s->cx > sx - 1) {
+	if (s->cx > sx - width) {
 		log_debug("%s: wrapped at %u,%u", __func__, s->cx, s->cy);
 		ci->wrapped = 1;
 		screen_write_linefeed(ctx, 1, 8);
 		s->cx = 0;
 	}
 
+	if (size != 1 &&
+	    !screen_write_collect_fits(ctx, gc, s->cx + ci->width)) {
+		screen_write_collect_end(ctx);
+		screen_write_collect_flush(ctx, 0);
+		screen_write_cell(ctx, gc);
+		return;
+	}
+	ctx->cells++;
+
 	if (ci->used == 0)
 		memcpy(&ci->gc, gc, sizeof ci->gc);
-	ci->data[ci->used++] = gc->data.data[0];
+	memcpy(ci->data + ci->used, gc->data.data, size);
+	ci->used += size;
+	ci->width += width;
+	if (size != 1)
+		ci->utf8 = 1;
 	if (ci->used == (sizeof ci->data) - 1)
 		screen_write_collect_end(ctx);
 }
@@ -1376,7 +1571,7 @@ screen_write_cell(struct screen_write_ctx *ctx, const struct grid_cell *gc)
 	screen_write_initctx(ctx, &ttyctx);
 
 	/* Handle overwriting of UTF-8 characters. */
-	gl = &s->grid->linedata[s->grid->hsize + s->cy];
+	gl = grid_get_line(s->grid, s->grid->hsize + s->cy);
 	if (gl->flags & GRID_LINE_EXTENDED) {
 		grid_view_get_cell(gd, s->cx, s->cy, &now_gc);
 		if (screen_write_overwrite(ctx, &now_gc, width))
@@ -1397,8 +1592,11 @@ screen_write_cell(struct screen_write_ctx *ctx, const struct grid_cell *gc)
 		if (s->cx >= gl->cellsize)
 			skip = grid_cells_equal(gc, &grid_default_cell);
 		else {
-			gce = &gl->celldata[s->cx];
-			if (gce->flags & GRID_FLAG_EXTENDED)
+			if (s->cx < gl->cellstored)
+				gce = &gl->celldata[s->cx];
+			else
+				gce = &gl->fill;
+			if (gce->flags & (GRID_FLAG_EXTENDED|GRID_FLAG_STYLED))
 				skip = 0;
 			else if (gc->flags != gce->flags)
 				skip = 0;
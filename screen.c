@@ -39,6 +39,7 @@ screen_init(struct screen *s, u_int sx, u_int sy, u_int hlimit)
 	s->cstyle = 0;
 	s->ccolour = xstrdup("");
 	s->tabs = NULL;
+	s->write_list = NULL;
 
 	screen_reinit(s);
 }
@@ -69,6 +70,7 @@ screen_free(struct screen *s)
 	free(s->tabs);
 	free(s->title);
 	free(s->ccolour);
+	free(s->write_list);
 	grid_destroy(s->grid);
 }
 
@@ -130,9 +132,14 @@ screen_resize(struct screen *s, u_int sx, u_int sy, int reflow)
 		screen_reset_tabs(s);
 	}
 
-	if (sy != screen_size_y(s))
+	if (sy != screen_size_y(s)) {
 		screen_resize_y(s, sy);
 
+		/* The write lines are one per row, so make new ones. */
+		free(s->write_list);
+		s->write_list = NULL;
+	}
+
 	if (reflow)
 		screen_reflow(s, sx);
 }
@@ -202,7 +209,7 @@ screen_resize_y(struct screen *s, u_int sy)
 		available = s->cy;
 		if (gd->flags & GRID_HISTORY) {
 			gd->hscrolled += needed;
-			gd->hsize += needed;
+			grid_set_hsize(gd, gd->hsize + needed);
 		} else if (needed > 0 && available > 0) {
 			if (available > needed)
 				available = needed;
@@ -212,13 +219,16 @@ screen_resize_y(struct screen *s, u_int sy)
 	}
 
 	/* Resize line arrays. */
-	gd->linedata = xreallocarray(gd->linedata, gd->hsize + sy,
-	    sizeof *gd->linedata);
+	grid_adjust_lines(gd, gd->hsize + sy);
 
 	/* Size increasing. */
 	if (sy > oldy) {
 		needed = sy - oldy;
 
+		/* Lines may be needed from history not yet reflowed. */
+		if (needed > gd->hscrolled)
+			grid_reflow_finish(gd);
+
 		/*
 		 * Try to pull as much as possible out of scrolled history, if
 		 * is is enabled.
@@ -228,7 +238,7 @@ screen_resize_y(struct screen *s, u_int sy)
 			if (available > needed)
 				available = needed;
 			gd->hscrolled -= available;
-			gd->hsize -= available;
+			grid_set_hsize(gd, gd->hsize - available);
 			s->cy += available;
 		} else
 			available = 0;
@@ -236,7 +246,7 @@ screen_resize_y(struct screen *s, u_int sy)
 
 		/* Then fill the rest in with blanks. */
 		for (i = gd->hsize + sy - needed; i < gd->hsize + sy; i++)
-			memset(&gd->linedata[i], 0, sizeof gd->linedata[i]);
+			memset(grid_get_line(gd, i), 0, sizeof *gd->linedata);
 	}
 
 	/* Set the new size, and reset the scroll region. */
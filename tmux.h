@@ -395,6 +395,7 @@ enum tty_code_code {
 	TTYC_KUP7,
 	TTYC_MS,
 	TTYC_OP,
+	TTYC_REP,
 	TTYC_REV,
 	TTYC_RI,
 	TTYC_RMACS,
@@ -543,10 +544,12 @@ enum utf8_state {
 #define GRID_FLAG_EXTENDED 0x8
 #define GRID_FLAG_SELECTED 0x10
 #define GRID_FLAG_NOPALETTE 0x20
+#define GRID_FLAG_STYLED 0x40
 
 /* Grid line flags. */
 #define GRID_LINE_WRAPPED 0x1
 #define GRID_LINE_EXTENDED 0x2
+#define GRID_LINE_COMPRESSED 0x4
 
 /* Grid cell data. */
 struct grid_cell {
@@ -569,19 +572,35 @@ struct grid_cell_entry {
 	};
 } __packed;
 
-/* Grid line. */
+/*
+ * Grid line. If the line is compressed, its cells are held in a block shared
+ * with other lines instead and only cellused, cellsize and flags are valid.
+ * Cells from cellstored to cellsize are all the same as the fill entry.
+ */
+struct grid_block;
 struct grid_line {
 	u_int			 cellused;
 	u_int			 cellsize;
-	struct grid_cell_entry	*celldata;
+	u_int			 cellstored;
+	struct grid_cell_entry	 fill;
+	union {
+		struct grid_cell_entry	*celldata;
+		struct grid_block	*block;
+	};
 
-	u_int			 extdsize;
+	union {
+		u_int			 extdsize;
+		u_int			 blockline;
+	};
 	struct grid_cell	*extddata;
 
 	int			 flags;
 } __packed;
 
 /* Entire grid of cells. */
+struct grid_arena;
+struct grid_styles;
+struct grid_index;
 struct grid {
 	int			 flags;
 #define GRID_HISTORY 0x1 /* scroll lines into history */
@@ -594,6 +613,21 @@ struct grid {
 	u_int			 hlimit;
 
 	struct grid_line	*linedata;
+	u_int			 linesize;
+	u_int			 lineoff;
+
+	u_int			 hfrozen;
+	struct grid_block	*hcached;
+	size_t			 hcompressed;
+
+	size_t			 hcellbytes;
+	size_t			 hextdbytes;
+
+	struct grid_arena	*arena;
+	struct grid_styles	*styles;
+
+	struct grid		*pending; /* history still to be reflowed */
+	struct grid_index	*index; /* first line of each logical line */
 };
 
 /* Hook data structures. */
@@ -633,6 +667,10 @@ struct job {
 };
 LIST_HEAD(joblist, job);
 
+/* Screen write collected lines and items. */
+struct screen_write_collect_item;
+struct screen_write_collect_line;
+
 /* Screen selection. */
 struct screen_sel {
 	int		 flag;
@@ -676,11 +714,11 @@ struct screen {
 	bitstr_t		*tabs;
 
 	struct screen_sel	 sel;
+
+	struct screen_write_collect_line *write_list; /* kept for writing */
 };
 
 /* Screen write context. */
-struct screen_write_collect_item;
-struct screen_write_collect_line;
 struct screen_write_ctx {
 	struct window_pane	*wp;
 	struct screen		*s;
@@ -772,6 +810,7 @@ struct window_pane {
 #define PANE_FOCUSPUSH 0x20
 #define PANE_INPUTOFF 0x40
 #define PANE_CHANGED 0x80
+#define PANE_RATELIMITED 0x100
 
 	int		 argc;
 	char	       **argv;
@@ -797,6 +836,14 @@ struct window_pane {
 	struct bufferevent *pipe_event;
 	size_t		 pipe_off;
 
+	size_t		 read_size;	/* most to read before parsing */
+	size_t		 read_average;	/* average bytes parsed at once */
+	struct event	 read_timer;
+
+	size_t		 rate_used;	/* bytes read this rate period */
+	struct timeval	 rate_start;
+	struct event	 rate_timer;
+
 	struct screen	*screen;
 	struct screen	 base;
 
@@ -816,6 +863,8 @@ struct window_pane {
 	u_int		 modeprefix;
 	char		*searchstr;
 
+	struct timeval	 used_time;
+
 	TAILQ_ENTRY(window_pane) entry;
 	RB_ENTRY(window_pane) tree_entry;
 };
@@ -1079,6 +1128,17 @@ struct tty {
 	struct event	 timer;
 	size_t		 discarded;
 
+	struct timeval	 write_time;
+	size_t		 write_bytes;
+	size_t		 bandwidth;
+
+	struct event	 frame_timer;
+	bitstr_t	*damage;
+	u_int		 damage_size;
+
+	struct grid	*shadow;
+	bitstr_t	*shadow_valid;
+
 	struct termios	 tio;
 
 	struct grid_cell cell;
@@ -1094,6 +1154,8 @@ struct tty {
 #define TTY_OPENED 0x20
 #define TTY_FOCUS 0x40
 #define TTY_BLOCK 0x80
+#define TTY_SHADOW 0x100
+#define TTY_DRAINED 0x200
 	int		 flags;
 
 	struct tty_term	*term;
@@ -1331,7 +1393,9 @@ struct client {
 
 	size_t		 written;
 	size_t		 discarded;
+	u_int		 discards;
 	size_t		 redraw;
+	size_t		 cursor_saved;
 
 	void		(*stdin_callback)(struct client *, int, void *);
 	void		*stdin_callback_data;
@@ -1963,14 +2027,22 @@ int	 attributes_fromstring(const char *);
 extern const struct grid_cell grid_default_cell;
 int	 grid_cells_equal(const struct grid_cell *, const struct grid_cell *);
 struct grid *grid_create(u_int, u_int, u_int);
+struct grid *grid_create_shared(struct grid *, u_int, u_int);
 void	 grid_destroy(struct grid *);
 int	 grid_compare(struct grid *, struct grid *);
 void	 grid_collect_history(struct grid *, u_int);
+void	 grid_trim_history(struct grid *, u_int);
+void	 grid_compress_all_history(struct grid *);
 void	 grid_scroll_history(struct grid *, u_int);
 void	 grid_scroll_history_region(struct grid *, u_int, u_int, u_int);
 void	 grid_clear_history(struct grid *);
+struct grid_line *grid_get_line(struct grid *, u_int);
+void	 grid_adjust_lines(struct grid *, u_int);
+void	 grid_history_bytes(struct grid *, size_t *, size_t *);
+void	 grid_set_hsize(struct grid *, u_int);
 const struct grid_line *grid_peek_line(struct grid *, u_int);
 void	 grid_get_cell(struct grid *, u_int, u_int, struct grid_cell *);
+int	 grid_line_chars(struct grid *, u_int, u_int, u_int, u_char *);
 void	 grid_set_cell(struct grid *, u_int, u_int, const struct grid_cell *);
 void	 grid_set_cells(struct grid *, u_int, u_int, const struct grid_cell *,
 	     const char *, size_t);
@@ -1982,7 +2054,11 @@ char	*grid_string_cells(struct grid *, u_int, u_int, u_int,
 	     struct grid_cell **, int, int, int);
 void	 grid_duplicate_lines(struct grid *, u_int, struct grid *, u_int,
 	     u_int);
+void	 grid_take_lines(struct grid *, u_int, struct grid *, u_int, u_int);
+void	 grid_wrapped_lines(struct grid *, u_int, u_int *, u_int *);
 u_int	 grid_reflow(struct grid *, struct grid *, u_int);
+int	 grid_reflow_pending(struct grid *);
+void	 grid_reflow_finish(struct grid *);
 
 /* grid-view.c */
 void	 grid_view_get_cell(struct grid *, u_int, u_int, struct grid_cell *);
@@ -2055,6 +2131,8 @@ void	 screen_write_clearstartofscreen(struct screen_write_ctx *, u_int);
 void	 screen_write_clearscreen(struct screen_write_ctx *, u_int);
 void	 screen_write_clearhistory(struct screen_write_ctx *);
 void	 screen_write_collect_end(struct screen_write_ctx *);
+void	 screen_write_collect_span(struct screen_write_ctx *,
+	     const struct grid_cell *, const u_char *, u_int);
 void	 screen_write_collect_add(struct screen_write_ctx *,
 	     const struct grid_cell *);
 void	 screen_write_cell(struct screen_write_ctx *, const struct grid_cell *);
@@ -2110,6 +2188,8 @@ void		 winlink_stack_remove(struct winlink_stack *, struct winlink *);
 struct window	*window_find_by_id_str(const char *);
 struct window	*window_find_by_id(u_int);
 void		 window_update_activity(struct window *);
+void		 window_history_timer_start(void);
+unsigned long long window_history_total_bytes(void);
 struct window	*window_create(u_int, u_int);
 struct window	*window_create_spawn(const char *, int, char **, const char *,
 		     const char *, const char *, struct environ *,
@@ -2330,6 +2410,7 @@ void		 utf8_set(struct utf8_data *, u_char);
 void		 utf8_copy(struct utf8_data *, const struct utf8_data *);
 enum utf8_state	 utf8_open(struct utf8_data *, u_char);
 enum utf8_state	 utf8_append(struct utf8_data *, u_char);
+enum utf8_state	 utf8_decode(struct utf8_data *, const u_char *, size_t);
 enum utf8_state	 utf8_combine(const struct utf8_data *, wchar_t *);
 enum utf8_state	 utf8_split(wchar_t, struct utf8_data *);
 int		 utf8_isvalid(const char *);
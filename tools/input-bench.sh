@@ -0,0 +1,62 @@
+#!/bin/sh
+
+# Time how fast tmux parses recorded output. Each file is written to a
+# detached pane several times and the best rate is reported. Where /proc is
+# available the CPU time used by the server is measured, otherwise the elapsed
+# time.
+#
+# Usage: input-bench.sh [-n runs] [-t tmux] file ...
+
+PATH=/bin:/usr/bin
+TERM=screen
+export LC_ALL=C.UTF-8
+
+RUNS=5
+TEST_TMUX=$(readlink -f ../tmux)
+while getopts n:t: opt; do
+	case $opt in
+	n) RUNS=$OPTARG;;
+	t) TEST_TMUX=$(readlink -f $OPTARG);;
+	*) echo "usage: $0 [-n runs] [-t tmux] file ..." >&2; exit 1;;
+	esac
+done
+shift $((OPTIND - 1))
+
+# Print the current time in microseconds, CPU time if the server pid is given.
+now() {
+	if [ -n "$1" ]; then
+		awk -vhz=$(getconf CLK_TCK) \
+		    '{ printf "%d\n", ($14 + $15) * 1000000 / hz }' /proc/$1/stat
+	else
+		echo $(($(date +%s%N) / 1000))
+	fi
+}
+
+for f in "$@"; do
+	f=$(readlink -f $f)
+	size=$(wc -c <$f)
+	best=0
+	i=0
+	while [ $i -lt $RUNS ]; do
+		TMUX="$TEST_TMUX -Lbench$$.$i -f/dev/null"
+		$TMUX new -d -x120 -y40 \
+		    "$TMUX wait go; cat $f; $TMUX wait -S done; sleep 10" \
+		    </dev/null || exit 1
+		pid=$($TMUX display -p '#{pid}')
+		[ -r /proc/$pid/stat ] || pid=
+		start=$(now $pid)
+		$TMUX wait -S go
+		$TMUX wait done
+		end=$(now $pid)
+		$TMUX kill-server 2>/dev/null
+
+		us=$((end - start))
+		[ $us -le 0 ] && us=1
+		if [ $best -eq 0 ] || [ $us -lt $best ]; then
+			best=$us
+		fi
+		i=$((i + 1))
+	done
+	echo "$(basename $f): $size bytes, $((best / 1000)) ms," \
+	    "$((size / best)) MB/s"
+done
@@ -0,0 +1,62 @@
+#!/bin/sh
+
+# Count the bytes tmux writes to a terminal to draw recorded output. Each file
+# is written to a pane with a client attached (running inside another tmux as
+# its terminal), then the client switches to an empty window and back several
+# times and the average number of bytes written each time the pane is drawn
+# is reported. Running the same files with two builds gives the bytes per
+# frame before and after a change.
+#
+# Usage: output-bench.sh [-n frames] [-T term] [-t tmux] file ...
+
+PATH=/bin:/usr/bin
+TERM=screen
+export LC_ALL=C.UTF-8
+
+FRAMES=10
+CLIENT_TERM=screen
+TEST_TMUX=$(readlink -f ../tmux)
+while getopts n:T:t: opt; do
+	case $opt in
+	n) FRAMES=$OPTARG;;
+	T) CLIENT_TERM=$OPTARG;;
+	t) TEST_TMUX=$(readlink -f $OPTARG);;
+	*) echo "usage: $0 [-n frames] [-T term] [-t tmux] file ..." >&2
+	   exit 1;;
+	esac
+done
+shift $((OPTIND - 1))
+
+# Print the bytes written to the attached client so far.
+written() {
+	sleep 0.5
+	$TMUX display -p '#{client_written}'
+}
+
+for f in "$@"; do
+	f=$(readlink -f $f)
+	TMUX="$TEST_TMUX -Lbench$$ -f/dev/null"
+	OUTER="$TEST_TMUX -Lbench$$.outer -f/dev/null"
+	$TMUX new -d -x80 -y24 "$TMUX wait go; cat $f; $TMUX wait -S done; sleep 60" \
+	    </dev/null || exit 1
+	$OUTER new -d -x80 -y25 "TERM=$CLIENT_TERM $TMUX attach" </dev/null ||
+	    exit 1
+	while [ -z "$($TMUX list-clients)" ]; do
+		sleep 0.1
+	done
+	$TMUX wait -S go
+	$TMUX wait done
+	$TMUX neww -d "sleep 60"
+	start=$(written)
+	i=0
+	while [ $i -lt $FRAMES ]; do
+		$TMUX next
+		$TMUX next
+		i=$((i + 1))
+	done
+	end=$(written)
+	$TMUX kill-server 2>/dev/null
+	$OUTER kill-server 2>/dev/null
+
+	echo "$(basename $f): $(((end - start) / FRAMES)) bytes per frame"
+done
@@ -237,6 +237,7 @@ static const struct tty_term_code_entry tty_term_codes[] = {
 	[TTYC_KUP7] = { TTYCODE_STRING, "kUP7" },
 	[TTYC_MS] = { TTYCODE_STRING, "Ms" },
 	[TTYC_OP] = { TTYCODE_STRING, "op" },
+	[TTYC_REP] = { TTYCODE_STRING, "rep" },
 	[TTYC_REV] = { TTYCODE_STRING, "rev" },
 	[TTYC_RI] = { TTYCODE_STRING, "ri" },
 	[TTYC_RMACS] = { TTYCODE_STRING, "rmacs" },
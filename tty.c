@@ -34,23 +34,105 @@
 
 static int	tty_log_fd = -1;
 
-static int	tty_client_ready(struct client *, struct window_pane *);
+/* Ways of moving the cursor. */
+enum tty_move_type {
+	TTY_MOVE_NONE,
+	TTY_MOVE_REPEAT,	/* sequence without argument, n times */
+	TTY_MOVE_ARGUMENT,	/* sequence with argument n */
+	TTY_MOVE_LINEFEED,	/* n line feeds */
+	TTY_MOVE_OVERWRITE	/* write n characters already shown */
+};
+struct tty_move {
+	enum tty_move_type	type;
+	enum tty_code_code	code;
+	u_int			n;
+	u_int			cost;
+};
+#define TTY_MOVE_OVERWRITE_MAX 8
+
+/* Attribute and colour changes collected into as few sequences as possible. */
+struct tty_sgr {
+	struct tty		*tty;
+	struct grid_cell	 cell;	/* terminal state after the changes */
+	int			 direct;
+
+	char			 out[256];
+	size_t			 used;
+	int			 overflow;
+
+	char			 params[64];
+	size_t			 nparams;
+};
+
+/* SGR parameters which turn attributes on and off. */
+static const struct {
+	int		 attr;
+	const char	*on;
+	const char	*off;
+} tty_sgr_attrs[] = {
+	{ GRID_ATTR_BRIGHT, "1", "22" },
+	{ GRID_ATTR_DIM, "2", "22" },
+	{ GRID_ATTR_ITALICS, "3", "23" },
+	{ GRID_ATTR_UNDERSCORE, "4", "24" },
+	{ GRID_ATTR_BLINK, "5", "25" },
+	{ GRID_ATTR_REVERSE, "7", "27" },
+	{ GRID_ATTR_HIDDEN, "8", "28" },
+	{ GRID_ATTR_STRIKETHROUGH, "9", "29" }
+};
 
-static void	tty_set_italics(struct tty *);
-static int	tty_try_colour(struct tty *, int, const char *);
+static int	tty_client_ready(struct client *, struct window_pane *);
+static void	tty_bandwidth_update(struct tty *, size_t);
+static size_t	tty_block_start(struct tty *);
+static void	tty_block_interval(struct tty *, struct timeval *);
+static int	tty_damage_lines(void (*)(struct tty *, const struct tty_ctx *),
+		    const struct tty_ctx *, u_int *, u_int *);
+static void	tty_damage(struct tty *, u_int, u_int, u_int);
+
+static int	tty_shadow_size(struct tty *);
+static void	tty_shadow_invalidate(struct tty *, u_int, u_int, u_int,
+		    u_int);
+static void	tty_shadow_written(struct tty *, u_int);
+static int	tty_shadow_cell(struct tty *, const struct window_pane *,
+		    u_int, u_int, const struct grid_cell *);
+static int	tty_shadow_clear(struct tty *, const struct window_pane *,
+		    u_int, u_int, u_int, u_int);
+
+static enum tty_code_code tty_italics_code(struct tty *);
+static void	tty_sgr_init(struct tty_sgr *, struct tty *);
+static void	tty_sgr_out(struct tty_sgr *, const char *, size_t);
+static void	tty_sgr_flush(struct tty_sgr *);
+static void	tty_sgr_param(struct tty_sgr *, const char *, size_t);
+static void	tty_sgr_puts(struct tty_sgr *, const char *);
+static void	tty_sgr_putcode(struct tty_sgr *, enum tty_code_code);
+static void	tty_sgr_putcode1(struct tty_sgr *, enum tty_code_code, int);
+static void	tty_sgr_putcode3(struct tty_sgr *, enum tty_code_code, int,
+		    int, int);
+static void	tty_sgr_reset(struct tty_sgr *);
+static const char *tty_sgr_off(struct tty *, int);
+static int	tty_sgr_clear(struct tty_sgr *, int);
+static void	tty_sgr_set(struct tty_sgr *, const struct grid_cell *);
+static int	tty_try_colour(struct tty_sgr *, int, const char *);
 static void	tty_force_cursor_colour(struct tty *, const char *);
+static u_int	tty_move_cost(struct tty *, struct tty_move *);
+static void	tty_move_try(struct tty *, struct tty_move *,
+		    enum tty_move_type, enum tty_code_code, u_int);
+static int	tty_move_overwrite(struct tty *, u_int, u_int, u_int);
+static void	tty_move_column(struct tty *, u_int, u_int, u_int,
+		    struct tty_move *);
+static void	tty_move_row(struct tty *, u_int, u_int, struct tty_move *);
+static void	tty_move_write(struct tty *, const struct tty_move *);
 static void	tty_cursor_pane(struct tty *, const struct tty_ctx *, u_int,
 		    u_int);
 static void	tty_cursor_pane_unless_wrap(struct tty *,
 		    const struct tty_ctx *, u_int, u_int);
 static void	tty_invalidate(struct tty *);
-static void	tty_colours(struct tty *, const struct grid_cell *);
+static void	tty_colours(struct tty_sgr *, const struct grid_cell *);
 static void	tty_check_fg(struct tty *, const struct window_pane *,
 		    struct grid_cell *);
 static void	tty_check_bg(struct tty *, const struct window_pane *,
 		    struct grid_cell *);
-static void	tty_colours_fg(struct tty *, const struct grid_cell *);
-static void	tty_colours_bg(struct tty *, const struct grid_cell *);
+static void	tty_colours_fg(struct tty_sgr *, const struct grid_cell *);
+static void	tty_colours_bg(struct tty_sgr *, const struct grid_cell *);
 
 static void	tty_region_pane(struct tty *, const struct tty_ctx *, u_int,
 		    u_int);
@@ -63,7 +145,12 @@ static int	tty_fake_bce(const struct tty *, const struct window_pane *,
 static void	tty_redraw_region(struct tty *, const struct tty_ctx *);
 static void	tty_emulate_repeat(struct tty *, enum tty_code_code,
 		    enum tty_code_code, u_int);
+static const char *tty_repeat_string(struct tty *, u_int, size_t);
+static void	tty_putn_repeat(struct tty *, const u_char *, size_t);
 static void	tty_repeat_space(struct tty *, u_int);
+static void	tty_draw_cells(struct tty *, const struct window_pane *,
+		    const struct grid_cell *, const char *, size_t, u_int,
+		    u_int);
 static void	tty_cell(struct tty *, const struct grid_cell *,
 		    const struct window_pane *);
 static void	tty_default_colours(struct grid_cell *,
@@ -78,9 +165,16 @@ static void	tty_default_attributes(struct tty *, const struct window_pane *,
 	((ctx)->xoff == 0 && screen_size_x((ctx)->wp->screen) >= (tty)->sx)
 
 #define TTY_BLOCK_INTERVAL (100000 /* 100 milliseconds */)
+#define TTY_BLOCK_INTERVAL_MAX (1000000 /* 1 second */)
+#define TTY_BLOCK_LATENCY (250000 /* 250 milliseconds */)
 #define TTY_BLOCK_START(tty) (1 + ((tty)->sx * (tty)->sy) * 8)
 #define TTY_BLOCK_STOP(tty) (1 + ((tty)->sx * (tty)->sy) / 8)
 
+#define TTY_BANDWIDTH_INTERVAL (100000 /* 100 milliseconds */)
+
+/* Runs of this many bytes or fewer are never worth repeating or erasing. */
+#define TTY_REPEAT_MIN 4
+
 void
 tty_create_log(void)
 {
@@ -146,10 +240,146 @@ tty_resize(struct tty *tty)
 void
 tty_set_size(struct tty *tty, u_int sx, u_int sy)
 {
+	if (tty->shadow != NULL && (sx != tty->sx || sy != tty->sy)) {
+		grid_destroy(tty->shadow);
+		tty->shadow = NULL;
+		free(tty->shadow_valid);
+		tty->shadow_valid = NULL;
+	}
+
 	tty->sx = sx;
 	tty->sy = sy;
 }
 
+/* Make sure there is a shadow of the terminal. */
+static int
+tty_shadow_size(struct tty *tty)
+{
+	if (tty->shadow != NULL)
+		return (1);
+	if (tty->sx == 0 || tty->sy == 0)
+		return (0);
+
+	tty->shadow = grid_create(tty->sx, tty->sy, 0);
+	if ((tty->shadow_valid = bit_alloc(tty->sx * tty->sy)) == NULL)
+		fatal("bit_alloc failed");
+	return (1);
+}
+
+/* Forget what the terminal shows in an area. */
+static void
+tty_shadow_invalidate(struct tty *tty, u_int px, u_int py, u_int nx, u_int ny)
+{
+	struct grid	*gd = tty->shadow;
+	u_int		 yy;
+
+	if (gd == NULL || px >= gd->sx || py >= gd->sy)
+		return;
+	if (nx > gd->sx - px)
+		nx = gd->sx - px;
+	if (ny > gd->sy - py)
+		ny = gd->sy - py;
+	if (nx == 0 || ny == 0)
+		return;
+
+	if (nx == gd->sx) {
+		bit_nclear(tty->shadow_valid, py * gd->sx,
+		    (py + ny) * gd->sx - 1);
+		return;
+	}
+	for (yy = py; yy < py + ny; yy++) {
+		bit_nclear(tty->shadow_valid, yy * gd->sx + px,
+		    yy * gd->sx + px + nx - 1);
+	}
+}
+
+/* Forget cells about to be written at the cursor. */
+static void
+tty_shadow_written(struct tty *tty, u_int width)
+{
+	struct grid	*gd = tty->shadow;
+	u_int		 n, total;
+
+	if (gd == NULL || (tty->flags & TTY_SHADOW) || width == 0)
+		return;
+
+	/*
+	 * If the cursor is unknown or the text may scroll the terminal, forget
+	 * everything.
+	 */
+	total = gd->sx * gd->sy;
+	if (tty->cx > gd->sx || tty->cy >= gd->sy)
+		n = total;
+	else
+		n = tty->cy * gd->sx + tty->cx;
+	if (n + width > total) {
+		bit_nclear(tty->shadow_valid, 0, total - 1);
+		return;
+	}
+	bit_nclear(tty->shadow_valid, n, n + width - 1);
+}
+
+/*
+ * Record a cell about to be drawn in the shadow. Returns 1 if the terminal
+ * already shows it, so it can be skipped.
+ */
+static int
+tty_shadow_cell(struct tty *tty, const struct window_pane *wp, u_int px,
+    u_int py, const struct grid_cell *gc)
+{
+	struct grid		*gd = tty->shadow;
+	struct grid_cell	 sc, now;
+	u_int			 n, i;
+	int			 valid;
+
+	if (px >= gd->sx || py >= gd->sy)
+		return (0);
+
+	/*
+	 * Default colours and the palette depend on the pane, so compare the
+	 * colours actually sent to the terminal.
+	 */
+	memcpy(&sc, gc, sizeof sc);
+	if (wp != NULL)
+		tty_default_colours(&sc, wp);
+	tty_check_fg(tty, wp, &sc);
+	tty_check_bg(tty, wp, &sc);
+
+	/* A wide character is only there if the cells it covers are too. */
+	n = py * gd->sx + px;
+	valid = bit_test(tty->shadow_valid, n);
+	for (i = 1; valid && i < sc.data.width && px + i < gd->sx; i++)
+		valid = bit_test(tty->shadow_valid, n + i);
+	if (valid) {
+		grid_view_get_cell(gd, px, py, &now);
+		if (grid_cells_equal(&sc, &now))
+			return (1);
+	}
+
+	grid_view_set_cell(gd, px, py, &sc);
+	bit_set(tty->shadow_valid, n);
+	return (0);
+}
+
+/* Record cleared cells in the shadow. Returns 1 if they are already clear. */
+static int
+tty_shadow_clear(struct tty *tty, const struct window_pane *wp, u_int px,
+    u_int py, u_int nx, u_int bg)
+{
+	struct grid_cell	gc;
+	u_int			i;
+	int			same = 1;
+
+	memcpy(&gc, &grid_default_cell, sizeof gc);
+	gc.bg = bg;
+
+	for (i = 0; i < nx; i++) {
+		if (!tty_shadow_cell(tty, wp, px + i, py, &gc))
+			same = 0;
+	}
+	return (same);
+}
+
 static void
 tty_read_callback(__unused int fd, __unused short events, void *data)
 {
@@ -169,19 +399,130 @@ tty_read_callback(__unused int fd, __unused short events, void *data)
 		;
 }
 
+/*
+ * Update the estimate of how fast the terminal accepts output. The time is
+ * counted from when output started waiting; if it is not written at once,
+ * it is the terminal that is the limit.
+ */
+static void
+tty_bandwidth_update(struct tty *tty, size_t written)
+{
+	struct client	*c = tty->client;
+	struct timeval	 now, tv;
+	uint64_t	 us, rate;
+	int		 waiting, backlog;
+
+	if (!timerisset(&tty->write_time))
+		return;
+	gettimeofday(&now, NULL);
+
+	waiting = (EVBUFFER_LENGTH(tty->out) != 0);
+	backlog = (tty->write_bytes != 0);
+	tty->write_bytes += written;
+
+	/*
+	 * Take a sample every TTY_BANDWIDTH_INTERVAL while output is waiting,
+	 * or when it has all been written if that took more than one write.
+	 * Very short samples say little about the terminal.
+	 */
+	timersub(&now, &tty->write_time, &tv);
+	us = tv.tv_sec * 1000000ULL + tv.tv_usec;
+	if (us >= TTY_BANDWIDTH_INTERVAL ||
+	    (!waiting && backlog && us >= TTY_BANDWIDTH_INTERVAL / 10)) {
+		rate = tty->write_bytes * 1000000ULL / us;
+		if (tty->bandwidth == 0)
+			tty->bandwidth = rate;
+		else
+			tty->bandwidth = (tty->bandwidth * 3 + rate) / 4;
+		log_debug("%s: %zu bytes in %llu us, bandwidth %zu", c->name,
+		    tty->write_bytes, (unsigned long long)us, tty->bandwidth);
+	} else if (waiting)
+		return;
+
+	if (waiting)
+		memcpy(&tty->write_time, &now, sizeof tty->write_time);
+	else
+		timerclear(&tty->write_time);
+	tty->write_bytes = 0;
+}
+
+/*
+ * Get how much output may be waiting before discarding it. If the bandwidth is
+ * known, this is as much as can be sent in TTY_BLOCK_LATENCY, but at least one
+ * byte for each cell so a redraw is not discarded.
+ */
+static size_t
+tty_block_start(struct tty *tty)
+{
+	size_t	size = TTY_BLOCK_START(tty), limit;
+
+	if (tty->bandwidth != 0) {
+		limit = (uint64_t)tty->bandwidth * TTY_BLOCK_LATENCY / 1000000;
+		if (limit < (size_t)tty->sx * tty->sy)
+			limit = (size_t)tty->sx * tty->sy;
+		if (limit < size)
+			size = limit;
+	}
+	return (size);
+}
+
+/*
+ * Get how long to discard output for before trying again. This is long
+ * enough to send a redraw of about one byte for each cell at the estimated
+ * bandwidth, so a slow terminal is not given redraws faster than it can take
+ * them.
+ */
+static void
+tty_block_interval(struct tty *tty, struct timeval *tv)
+{
+	uint64_t	us = TTY_BLOCK_INTERVAL;
+
+	if (tty->bandwidth != 0) {
+		us = (uint64_t)tty->sx * tty->sy * 1000000 / tty->bandwidth;
+		if (us < TTY_BLOCK_INTERVAL)
+			us = TTY_BLOCK_INTERVAL;
+		if (us > TTY_BLOCK_INTERVAL_MAX)
+			us = TTY_BLOCK_INTERVAL_MAX;
+	}
+	tv->tv_sec = us / 1000000;
+	tv->tv_usec = us % 1000000;
+}
+
 static void
 tty_timer_callback(__unused int fd, __unused short events, void *data)
 {
 	struct tty	*tty = data;
 	struct client	*c = tty->client;
-	struct timeval	 tv = { .tv_usec = TTY_BLOCK_INTERVAL };
+	struct timeval	 tv;
+	size_t		 stop;
 
 	log_debug("%s: %zu discarded", c->name, tty->discarded);
 
 	c->flags |= CLIENT_REDRAW;
 	c->discarded += tty->discarded;
 
-	if (tty->discarded < TTY_BLOCK_STOP(tty)) {
+	/*
+	 * If a redraw was queued and has all been written since the last
+	 * interval, the terminal may be faster than estimated, so increase the
+	 * estimate. If it is wrong, output will back up again and it will be
+	 * measured.
+	 */
+	if (tty->bandwidth != 0 && (tty->flags & TTY_DRAINED))
+		tty->bandwidth += tty->bandwidth / 4;
+	tty->flags &= ~TTY_DRAINED;
+
+	/*
+	 * Stop discarding if what would have been written in the interval
+	 * could be sent in half of it.
+	 */
+	tty_block_interval(tty, &tv);
+	if (tty->bandwidth == 0)
+		stop = TTY_BLOCK_STOP(tty);
+	else {
+		stop = (tv.tv_sec * 1000000ULL + tv.tv_usec) * tty->bandwidth /
+		    2000000;
+	}
+	if (tty->discarded < stop) {
 		tty->flags &= ~TTY_BLOCK;
 		tty_invalidate(tty);
 		return;
@@ -195,25 +536,67 @@ tty_block_maybe(struct tty *tty)
 {
 	struct client	*c = tty->client;
 	size_t		 size = EVBUFFER_LENGTH(tty->out);
-	struct timeval	 tv = { .tv_usec = TTY_BLOCK_INTERVAL };
+	struct timeval	 tv;
 
-	if (size < TTY_BLOCK_START(tty))
+	if (size < tty_block_start(tty))
 		return (0);
 
 	if (tty->flags & TTY_BLOCK)
 		return (1);
-	tty->flags |= TTY_BLOCK;
+	tty->flags = (tty->flags & ~TTY_DRAINED) | TTY_BLOCK;
 
 	log_debug("%s: can't keep up, %zu discarded", c->name, size);
 
 	evbuffer_drain(tty->out, size);
 	c->discarded += size;
+	c->discards++;
+	tty_shadow_invalidate(tty, 0, 0, UINT_MAX, UINT_MAX);
+	timerclear(&tty->write_time);
 
 	tty->discarded = 0;
+	tty_block_interval(tty, &tv);
 	evtimer_add(&tty->timer, &tv);
 	return (1);
 }
 
+static void
+tty_frame_callback(__unused int fd, __unused short events, void *data)
+{
+	struct tty		*tty = data;
+	struct client		*c = tty->client;
+	struct window_pane	*wp;
+	u_int			 yoff, py;
+	int			 flags;
+
+	if (c->session == NULL)
+		goto out;
+
+	flags = tty->flags & TTY_NOCURSOR;
+	tty->flags |= TTY_NOCURSOR;
+	tty_update_mode(tty, tty->mode, NULL);
+
+	TAILQ_FOREACH(wp, &c->session->curw->window->panes, entry) {
+		if (!tty_client_ready(c, wp) || !window_pane_visible(wp))
+			continue;
+		yoff = wp->yoff;
+		if (status_at_line(c) == 0)
+			yoff++;
+		for (py = 0; py < screen_size_y(wp->screen); py++) {
+			if (yoff + py >= tty->damage_size)
+				break;
+			if (bit_test(tty->damage, yoff + py))
+				tty_draw_pane(tty, wp, py, wp->xoff, yoff);
+		}
+	}
+
+	tty->flags = (tty->flags & ~TTY_NOCURSOR) | flags;
+	tty_update_mode(tty, tty->mode, NULL);
+
+out:
+	if (tty->damage_size != 0)
+		bit_nclear(tty->damage, 0, tty->damage_size - 1);
+}
+
 static void
 tty_write_callback(__unused int fd, __unused short events, void *data)
 {
@@ -226,6 +609,7 @@ tty_write_callback(__unused int fd, __unused short events, void *data)
 	if (nwrite == -1)
 		return;
 	log_debug("%s: wrote %d bytes (of %zu)", c->name, nwrite, size);
+	tty_bandwidth_update(tty, nwrite);
 
 	if (c->redraw > 0) {
 		if ((size_t)nwrite >= c->redraw)
@@ -234,6 +618,8 @@ tty_write_callback(__unused int fd, __unused short events, void *data)
 			c->redraw -= nwrite;
 		log_debug("%s: waiting for redraw, %zu bytes left", c->name,
 		    c->redraw);
+		if (c->redraw == 0 && (tty->flags & TTY_BLOCK))
+			tty->flags |= TTY_DRAINED;
 	} else if (tty_block_maybe(tty))
 		return;
 
@@ -261,6 +647,7 @@ tty_open(struct tty *tty, char **cause)
 	tty->out = evbuffer_new();
 
 	evtimer_set(&tty->timer, tty_timer_callback, tty);
+	evtimer_set(&tty->frame_timer, tty_frame_callback, tty);
 
 	tty_start_tty(tty);
 
@@ -334,7 +721,8 @@ tty_stop_tty(struct tty *tty)
 	tty->flags &= ~TTY_STARTED;
 
 	event_del(&tty->timer);
-	tty->flags &= ~TTY_BLOCK;
+	tty->flags &= ~(TTY_BLOCK|TTY_DRAINED);
+	timerclear(&tty->write_time);
 
 	event_del(&tty->event_in);
 	event_del(&tty->event_out);
@@ -388,6 +776,8 @@ tty_close(struct tty *tty)
 {
 	if (event_initialized(&tty->key_timer))
 		evtimer_del(&tty->key_timer);
+	if (event_initialized(&tty->frame_timer))
+		evtimer_del(&tty->frame_timer);
 	tty_stop_tty(tty);
 
 	if (tty->flags & TTY_OPENED) {
@@ -413,6 +803,10 @@ tty_free(struct tty *tty)
 {
 	tty_close(tty);
 
+	if (tty->shadow != NULL)
+		grid_destroy(tty->shadow);
+	free(tty->shadow_valid);
+	free(tty->damage);
 	free(tty->ccolour);
 	free(tty->term_name);
 }
@@ -432,6 +826,8 @@ tty_raw(struct tty *tty, const char *s)
 	ssize_t	n, slen;
 	u_int	i;
 
+	tty_shadow_invalidate(tty, 0, 0, UINT_MAX, UINT_MAX);
+
 	slen = strlen(s);
 	for (i = 0; i < 5; i++) {
 		n = write(tty->fd, s, slen);
@@ -501,6 +897,10 @@ tty_add(struct tty *tty, const char *buf, size_t len)
 		return;
 	}
 
+	if (EVBUFFER_LENGTH(tty->out) == 0 && !timerisset(&tty->write_time)) {
+		gettimeofday(&tty->write_time, NULL);
+		tty->write_bytes = 0;
+	}
 	evbuffer_add(tty->out, buf, len);
 	log_debug("%s: %.*s", c->name, (int)len, buf);
 	c->written += len;
@@ -523,6 +923,9 @@ tty_putc(struct tty *tty, u_char ch)
 {
 	const char	*acs;
 
+	if (ch >= 0x20 && ch != 0x7f)
+		tty_shadow_written(tty, 1);
+
 	if (tty->cell.attr & GRID_ATTR_CHARSET) {
 		acs = tty_acs_get(tty, ch);
 		if (acs != NULL)
@@ -553,6 +956,8 @@ tty_putc(struct tty *tty, u_char ch)
 void
 tty_putn(struct tty *tty, const void *buf, size_t len, u_int width)
 {
+	tty_shadow_written(tty, width);
+
 	tty_add(tty, buf, len);
 	if (tty->cx + width > tty->sx) {
 		tty->cx = (tty->cx + width) - tty->sx;
@@ -564,19 +969,17 @@ tty_putn(struct tty *tty, const void *buf, size_t len, u_int width)
 		tty->cx += width;
 }
 
-static void
-tty_set_italics(struct tty *tty)
+static enum tty_code_code
+tty_italics_code(struct tty *tty)
 {
 	const char	*s;
 
 	if (tty_term_has(tty->term, TTYC_SITM)) {
 		s = options_get_string(global_options, "default-terminal");
-		if (strcmp(s, "screen") != 0 && strncmp(s, "screen-", 7) != 0) {
-			tty_putcode(tty, TTYC_SITM);
-			return;
-		}
+		if (strcmp(s, "screen") != 0 && strncmp(s, "screen-", 7) != 0)
+			return (TTYC_SITM);
 	}
-	tty_putcode(tty, TTYC_SMSO);
+	return (TTYC_SMSO);
 }
 
 void
@@ -681,14 +1084,63 @@ tty_emulate_repeat(struct tty *tty, enum tty_code_code code,
 	}
 }
 
+/*
+ * Get the sequence to repeat the last character written n more times, if it
+ * is shorter than writing the character (of size bytes) again. The rep
+ * capability writes the character itself first, so if it does that the
+ * remainder can follow any character, including UTF-8.
+ */
+static const char *
+tty_repeat_string(struct tty *tty, u_int n, size_t size)
+{
+	const char	*s;
+
+	if (n * size <= TTY_REPEAT_MIN || !tty_term_has(tty->term, TTYC_REP))
+		return (NULL);
+	s = tty_term_string2(tty->term, TTYC_REP, ' ', n + 1);
+	if (*s != ' ' || s[1] == '\0' || strlen(s + 1) >= n * size)
+		return (NULL);
+	return (s + 1);
+}
+
+/* Write ASCII text, repeating runs of the same character where shorter. */
+static void
+tty_putn_repeat(struct tty *tty, const u_char *buf, size_t len)
+{
+	const char	*s;
+	size_t		 start = 0, i, n;
+
+	for (i = 0; i < len; i += n) {
+		for (n = 1; i + n < len && buf[i + n] == buf[i]; n++)
+			/* nothing */;
+		if (buf[i] < 0x20 || buf[i] == 0x7f)
+			continue;
+		if ((s = tty_repeat_string(tty, n - 1, 1)) == NULL)
+			continue;
+
+		tty_putn(tty, buf + start, i + 1 - start, i + 1 - start);
+		tty_putn(tty, s, strlen(s), n - 1);
+		start = i + n;
+	}
+	if (start != len)
+		tty_putn(tty, buf + start, len - start, len - start);
+}
+
 static void
 tty_repeat_space(struct tty *tty, u_int n)
 {
-	static char s[500];
+	static char	 s[500];
+	const char	*rs;
 
 	if (*s != ' ')
 		memset(s, ' ', sizeof s);
 
+	if (n > 1 && (rs = tty_repeat_string(tty, n - 1, 1)) != NULL) {
+		tty_putn(tty, s, 1, 1);
+		tty_putn(tty, rs, strlen(rs), n - 1);
+		return;
+	}
+
 	while (n > sizeof s) {
 		tty_putn(tty, s, sizeof s, sizeof s);
 		n -= sizeof s;
@@ -877,20 +1329,75 @@ tty_draw_pane(struct tty *tty, const struct window_pane *wp, u_int py, u_int ox,
 	tty_draw_line(tty, wp, wp->screen, py, ox, oy);
 }
 
+/*
+ * Write cells buffered by tty_draw_line. The last n cells are the same as gc;
+ * if it is shorter, repeat the character or, for spaces, erase them and move
+ * the cursor over them.
+ */
+static void
+tty_draw_cells(struct tty *tty, const struct window_pane *wp,
+    const struct grid_cell *gc, const char *buf, size_t len, u_int width,
+    u_int n)
+{
+	struct tty_term	*term = tty->term;
+	const char	*s;
+	size_t		 size = gc->data.size, cost;
+	u_int		 cx;
+
+	if (n < 2 || gc->data.width != 1 || n * size <= TTY_REPEAT_MIN) {
+		tty_putn(tty, buf, len, width);
+		return;
+	}
+
+	if ((s = tty_repeat_string(tty, n - 1, size)) != NULL) {
+		tty_putn(tty, buf, len - (n - 1) * size, width - (n - 1));
+		tty_putn(tty, s, strlen(s), n - 1);
+		return;
+	}
+
+	tty_putn(tty, buf, len - n * size, width - n);
+	cx = tty->cx;
+	if (size == 1 &&
+	    *gc->data.data == ' ' &&
+	    tty->cell.attr == 0 &&
+	    cx < tty->sx &&
+	    cx + n < tty->sx &&
+	    tty->cy < tty->sy &&
+	    tty_term_has(term, TTYC_ECH) &&
+	    tty_term_has(term, TTYC_CUF) &&
+	    !tty_fake_bce(tty, wp, gc->bg)) {
+		cost = strlen(tty_term_string1(term, TTYC_ECH, n));
+		cost += strlen(tty_term_string1(term, TTYC_CUF, n));
+		if (cost < n) {
+			tty_putcode1(tty, TTYC_ECH, n);
+			tty_cursor(tty, cx + n, tty->cy);
+			return;
+		}
+	}
+	tty_putn(tty, buf + len - n * size, n * size, n);
+}
+
 void
 tty_draw_line(struct tty *tty, const struct window_pane *wp,
     struct screen *s, u_int py, u_int ox, u_int oy)
 {
-	struct grid_cell	 gc, last;
-	u_int			 i, j, sx, nx, width;
-	int			 flags, cleared = 0;
+	struct grid_cell	 gc, last, dc;
+	struct grid_line	*gl;
+	u_int			 i, j, sx, rx, nx, width, repeat = 0, bg = 8;
+	int			 flags, cleared = 0, shadow, skipped = 0, same;
 	char			 buf[512];
 	size_t			 len;
 
-	flags = (tty->flags & TTY_NOCURSOR);
-	tty->flags |= TTY_NOCURSOR;
+	flags = (tty->flags & (TTY_NOCURSOR|TTY_SHADOW));
+	tty->flags |= (TTY_NOCURSOR|TTY_SHADOW);
 	tty_update_mode(tty, tty->mode, s);
 
+	/*
+	 * Cells the terminal already shows are skipped, unless output is being
+	 * discarded and nothing drawn can be trusted.
+	 */
+	shadow = (~tty->flags & TTY_BLOCK) && tty_shadow_size(tty);
+
 	tty_region_off(tty);
 	tty_margin_off(tty);
 
@@ -899,18 +1406,40 @@ tty_draw_line(struct tty *tty, const struct window_pane *wp,
 	 * there may be empty background cells after it (from BCE).
 	 */
 	sx = screen_size_x(s);
-	if (sx > s->grid->linedata[s->grid->hsize + py].cellsize)
-		sx = s->grid->linedata[s->grid->hsize + py].cellsize;
+	gl = grid_get_line(s->grid, s->grid->hsize + py);
+	if (sx > gl->cellsize)
+		sx = gl->cellsize;
 	if (sx > tty->sx)
 		sx = tty->sx;
 
+	/*
+	 * If the line ends in a run of cleared cells, clear them in one go
+	 * rather than drawing each.
+	 */
+	rx = sx;
+	if (gl->cellstored < sx) {
+		grid_view_get_cell(s->grid, gl->cellstored, py, &gc);
+		if (gc.flags == 0 &&
+		    gc.attr == 0 &&
+		    gc.fg == 8 &&
+		    gc.data.size == 1 &&
+		    gc.data.width == 1 &&
+		    *gc.data.data == ' ') {
+			rx = gl->cellstored;
+			bg = gc.bg;
+		}
+	}
+
 	if (wp == NULL ||
 	    py == 0 ||
-	    (~s->grid->linedata[s->grid->hsize + py - 1].flags & GRID_LINE_WRAPPED) ||
+	    (~grid_get_line(s->grid, s->grid->hsize + py - 1)->flags &
+	    GRID_LINE_WRAPPED) ||
 	    ox != 0 ||
 	    tty->cx < tty->sx ||
+	    tty->cy != oy + py - 1 ||
 	    screen_size_x(s) < tty->sx) {
-		if (screen_size_x(s) < tty->sx &&
+		if (!shadow &&
+		    screen_size_x(s) < tty->sx &&
 		    ox == 0 &&
 		    sx != screen_size_x(s) &&
 		    tty_term_has(tty->term, TTYC_EL1) &&
@@ -929,8 +1458,34 @@ tty_draw_line(struct tty *tty, const struct window_pane *wp,
 	len = 0;
 	width = 0;
 
-	for (i = 0; i < sx; i++) {
+	for (i = 0; i < rx; i++) {
 		grid_view_get_cell(s->grid, i, py, &gc);
+		if (shadow) {
+			memcpy(&dc, &gc, sizeof dc);
+			if (gc.flags & GRID_FLAG_SELECTED)
+				screen_select_cell(s, &dc, &gc);
+			if (tty_shadow_cell(tty, wp, ox + i, oy + py, &dc)) {
+				if (len != 0) {
+					tty_attributes(tty, &last, wp);
+					tty_draw_cells(tty, wp, &last, buf, len,
+					    width, repeat);
+					len = 0;
+					width = 0;
+				}
+				skipped = 1;
+				continue;
+			}
+			if (skipped) {
+				tty_cursor(tty, ox + i, oy + py);
+				skipped = 0;
+			}
+		}
+		/*
+		 * Is this the same character as the last? If not and there
+		 * was a long enough run, write it now so it can be repeated.
+		 */
+		same = (gc.data.size == last.data.size &&
+		    memcmp(gc.data.data, last.data.data, gc.data.size) == 0);
 		if (len != 0 &&
 		    (((~tty->flags & TTY_UTF8) &&
 		    (gc.data.size != 1 ||
@@ -941,9 +1496,10 @@ tty_draw_line(struct tty *tty, const struct window_pane *wp,
 		    gc.attr != last.attr ||
 		    gc.fg != last.fg ||
 		    gc.bg != last.bg ||
+		    (!same && repeat * last.data.size > TTY_REPEAT_MIN) ||
 		    (sizeof buf) - len < gc.data.size)) {
 			tty_attributes(tty, &last, wp);
-			tty_putn(tty, buf, len, width);
+			tty_draw_cells(tty, wp, &last, buf, len, width, repeat);
 
 			len = 0;
 			width = 0;
@@ -967,6 +1523,10 @@ tty_draw_line(struct tty *tty, const struct window_pane *wp,
 					tty_putc(tty, gc.data.data[j]);
 			}
 		} else {
+			if (len != 0 && same)
+				repeat++;
+			else
+				repeat = 1;
 			memcpy(buf + len, gc.data.data, gc.data.size);
 			len += gc.data.size;
 			width += gc.data.width;
@@ -974,16 +1534,22 @@ tty_draw_line(struct tty *tty, const struct window_pane *wp,
 	}
 	if (len != 0) {
 		tty_attributes(tty, &last, wp);
-		tty_putn(tty, buf, len, width);
+		tty_draw_cells(tty, wp, &last, buf, len, width, repeat);
+	}
+	if (rx != sx && (!shadow ||
+	    !tty_shadow_clear(tty, wp, ox + rx, oy + py, sx - rx, bg))) {
+		tty_default_attributes(tty, wp, bg);
+		tty_clear_line(tty, wp, oy + py, ox + rx, sx - rx, bg);
 	}
 
 	nx = screen_size_x(s) - sx;
-	if (!cleared && sx < tty->sx && nx != 0) {
+	if (!cleared && sx < tty->sx && nx != 0 && (!shadow ||
+	    !tty_shadow_clear(tty, wp, ox + sx, oy + py, nx, 8))) {
 		tty_default_attributes(tty, wp, 8);
 		tty_clear_line(tty, wp, oy + py, ox + sx, nx, 8);
 	}
 
-	tty->flags = (tty->flags & ~TTY_NOCURSOR) | flags;
+	tty->flags = (tty->flags & ~(TTY_NOCURSOR|TTY_SHADOW)) | flags;
 	tty_update_mode(tty, tty->mode, s);
 }
 
@@ -1001,12 +1567,86 @@ tty_client_ready(struct client *c, struct window_pane *wp)
 	return (1);
 }
 
+/*
+ * Work out the lines of the pane changed by a command. Returns 0 if the command
+ * does not change the pane and must be written immediately.
+ */
+static int
+tty_damage_lines(void (*cmdfn)(struct tty *, const struct tty_ctx *),
+    const struct tty_ctx *ctx, u_int *py, u_int *ny)
+{
+	u_int	sy = screen_size_y(ctx->wp->screen);
+
+	if (cmdfn == tty_cmd_setselection || cmdfn == tty_cmd_rawstring)
+		return (0);
+
+	*py = ctx->ocy;
+	*ny = 1;
+
+	if ((cmdfn == tty_cmd_linefeed && ctx->ocy != ctx->orlower) ||
+	    (cmdfn == tty_cmd_reverseindex && ctx->ocy != ctx->orupper))
+		*ny = 0;
+	else if (cmdfn == tty_cmd_linefeed ||
+	    cmdfn == tty_cmd_reverseindex ||
+	    cmdfn == tty_cmd_scrollup) {
+		*py = ctx->orupper;
+		*ny = ctx->orlower - ctx->orupper + 1;
+	} else if (cmdfn == tty_cmd_insertline ||
+	    cmdfn == tty_cmd_deleteline) {
+		if (ctx->ocy < ctx->orupper || ctx->ocy > ctx->orlower)
+			*ny = sy - ctx->ocy;
+		else {
+			*py = ctx->orupper;
+			*ny = ctx->orlower - ctx->orupper + 1;
+		}
+	} else if (cmdfn == tty_cmd_clearendofscreen)
+		*ny = sy - ctx->ocy;
+	else if (cmdfn == tty_cmd_clearstartofscreen) {
+		*py = 0;
+		*ny = ctx->ocy + 1;
+	} else if (cmdfn == tty_cmd_clearscreen ||
+	    cmdfn == tty_cmd_alignmenttest) {
+		*py = 0;
+		*ny = sy;
+	}
+	return (1);
+}
+
+/* Mark lines of the terminal to be drawn at the next frame. */
+static void
+tty_damage(struct tty *tty, u_int py, u_int ny, u_int rate)
+{
+	struct timeval	tv;
+	u_int		usec = 1000000 / rate;
+
+	if (tty->damage == NULL || tty->damage_size != tty->sy) {
+		free(tty->damage);
+		tty->damage_size = tty->sy;
+		if ((tty->damage = bit_alloc(tty->damage_size)) == NULL)
+			fatal("bit_alloc failed");
+	}
+
+	if (ny == 0 || py >= tty->damage_size)
+		return;
+	if (py + ny > tty->damage_size)
+		ny = tty->damage_size - py;
+	bit_nset(tty->damage, py, py + ny - 1);
+
+	if (!evtimer_pending(&tty->frame_timer, NULL)) {
+		tv.tv_sec = usec / 1000000;
+		tv.tv_usec = usec % 1000000;
+		evtimer_add(&tty->frame_timer, &tv);
+	}
+}
+
 void
 tty_write(void (*cmdfn)(struct tty *, const struct tty_ctx *),
     struct tty_ctx *ctx)
 {
 	struct window_pane	*wp = ctx->wp;
 	struct client		*c;
+	u_int			 rate, py = 0, ny = 0;
+	int			 lines;
 
 	/* wp can be NULL if updating the screen but not the terminal. */
 	if (wp == NULL)
@@ -1015,6 +1655,14 @@ tty_write(void (*cmdfn)(struct tty *, const struct tty_ctx *),
 	if ((wp->flags & (PANE_REDRAW|PANE_DROP)) || !window_pane_visible(wp))
 		return;
 
+	/*
+	 * If output is drawn at a fixed frame rate, just note which lines have
+	 * changed and leave them to the frame timer. Otherwise the terminal
+	 * will no longer match the shadow for those lines.
+	 */
+	lines = tty_damage_lines(cmdfn, ctx, &py, &ny);
+	rate = options_get_number(global_options, "frame-rate");
+
 	TAILQ_FOREACH(c, &clients, entry) {
 		if (!tty_client_ready(c, wp))
 			continue;
@@ -1024,6 +1672,14 @@ tty_write(void (*cmdfn)(struct tty *, const struct tty_ctx *),
 		if (status_at_line(c) == 0)
 			ctx->yoff++;
 
+		if (lines && rate != 0) {
+			tty_damage(&c->tty, ctx->yoff + py, ny, rate);
+			continue;
+		}
+		if (lines) {
+			tty_shadow_invalidate(&c->tty, ctx->xoff, ctx->yoff + py,
+			    screen_size_x(wp->screen), ny);
+		}
 		cmdfn(&c->tty, ctx);
 	}
 }
@@ -1349,10 +2005,41 @@ tty_cmd_cell(struct tty *tty, const struct tty_ctx *ctx)
 void
 tty_cmd_cells(struct tty *tty, const struct tty_ctx *ctx)
 {
+	const u_char		*ptr = ctx->ptr, *end = ptr + ctx->num;
+	struct utf8_data	 ud;
+	u_int			 width = 0, i;
+
 	tty_cursor_pane_unless_wrap(tty, ctx, ctx->ocx, ctx->ocy);
 
 	tty_attributes(tty, ctx->cell, ctx->wp);
-	tty_putn(tty, ctx->ptr, ctx->num, ctx->num);
+
+	/* Plain ASCII is one cell per byte. */
+	while (ptr != end && *ptr <= 0x7f)
+		ptr++;
+	if (ptr == end) {
+		tty_putn_repeat(tty, ctx->ptr, ctx->num);
+		return;
+	}
+
+	/*
+	 * Otherwise work out the width of each character, writing it as _ if
+	 * the terminal does not support UTF-8.
+	 */
+	for (ptr = ctx->ptr; ptr != end; ptr += ud.size) {
+		if (*ptr <= 0x7f ||
+		    utf8_decode(&ud, ptr, end - ptr) != UTF8_DONE)
+			utf8_set(&ud, *ptr);
+		if (tty->flags & TTY_UTF8)
+			width += ud.width;
+		else if (ud.size == 1)
+			tty_putc(tty, *ptr);
+		else {
+			for (i = 0; i < ud.width; i++)
+				tty_putc(tty, '_');
+		}
+	}
+	if (tty->flags & TTY_UTF8)
+		tty_putn(tty, ctx->ptr, ctx->num, width);
 }
 
 void
@@ -1437,6 +2124,8 @@ tty_reset(struct tty *tty)
 static void
 tty_invalidate(struct tty *tty)
 {
+	tty_shadow_invalidate(tty, 0, 0, UINT_MAX, UINT_MAX);
+
 	memcpy(&tty->cell, &grid_default_cell, sizeof tty->cell);
 
 	memcpy(&tty->last_cell, &grid_default_cell, sizeof tty->last_cell);
@@ -1565,13 +2254,180 @@ tty_cursor_pane(struct tty *tty, const struct tty_ctx *ctx, u_int cx, u_int cy)
 	tty_cursor(tty, ctx->xoff + cx, ctx->yoff + cy);
 }
 
-/* Move cursor to absolute position. */
+/* Work out the cost in bytes of a cursor movement. */
+static u_int
+tty_move_cost(struct tty *tty, struct tty_move *m)
+{
+	struct tty_term	*term = tty->term;
+
+	switch (m->type) {
+	case TTY_MOVE_NONE:
+		return (0);
+	case TTY_MOVE_REPEAT:
+		if (!tty_term_has(term, m->code))
+			return (UINT_MAX);
+		return (strlen(tty_term_string(term, m->code)) * m->n);
+	case TTY_MOVE_ARGUMENT:
+		if (!tty_term_has(term, m->code))
+			return (UINT_MAX);
+		return (strlen(tty_term_string1(term, m->code, m->n)));
+	case TTY_MOVE_LINEFEED:
+	case TTY_MOVE_OVERWRITE:
+		return (m->n);
+	}
+	return (UINT_MAX);
+}
+
+/* Keep a cursor movement if it is cheaper than the best so far. */
+static void
+tty_move_try(struct tty *tty, struct tty_move *best,
+    enum tty_move_type type, enum tty_code_code code, u_int n)
+{
+	struct tty_move	m = { .type = type, .code = code, .n = n };
+
+	/* Nothing with an argument is shorter than three bytes. */
+	if (type == TTY_MOVE_ARGUMENT && best->cost <= 3)
+		return;
+
+	m.cost = tty_move_cost(tty, &m);
+	if (m.cost < best->cost)
+		memcpy(best, &m, sizeof *best);
+}
+
+/*
+ * Check if the cursor can be moved right by writing the characters the
+ * terminal already shows, which must be plain single width characters with
+ * the current attributes.
+ */
+static int
+tty_move_overwrite(struct tty *tty, u_int x0, u_int cx, u_int cy)
+{
+	struct grid		*gd = tty->shadow;
+	struct grid_cell	*tc = &tty->cell, gc;
+	u_int			 x;
+
+	if (gd == NULL || cx - x0 > TTY_MOVE_OVERWRITE_MAX || cy >= gd->sy)
+		return (0);
+	for (x = x0; x < cx; x++) {
+		if (!bit_test(tty->shadow_valid, cy * gd->sx + x))
+			return (0);
+		grid_view_get_cell(gd, x, cy, &gc);
+		if (gc.flags != 0 ||
+		    (gc.attr & GRID_ATTR_CHARSET) ||
+		    gc.attr != tc->attr ||
+		    gc.fg != tc->fg ||
+		    gc.bg != tc->bg ||
+		    gc.data.size != 1 ||
+		    gc.data.width != 1 ||
+		    *gc.data.data < 0x20 ||
+		    *gc.data.data >= 0x7f)
+			return (0);
+	}
+	return (1);
+}
+
+/* Find the cheapest way to move the cursor between columns. */
+static void
+tty_move_column(struct tty *tty, u_int x0, u_int cx, u_int cy,
+    struct tty_move *m)
+{
+	memset(m, 0, sizeof *m);
+	if (x0 == cx) {
+		m->type = TTY_MOVE_NONE;
+		return;
+	}
+	m->cost = UINT_MAX;
+
+	if (cx < x0) {
+		tty_move_try(tty, m, TTY_MOVE_REPEAT, TTYC_CUB1, x0 - cx);
+		tty_move_try(tty, m, TTY_MOVE_ARGUMENT, TTYC_CUB, x0 - cx);
+	} else {
+		if (tty_move_overwrite(tty, x0, cx, cy))
+			tty_move_try(tty, m, TTY_MOVE_OVERWRITE, 0, cx - x0);
+		tty_move_try(tty, m, TTY_MOVE_REPEAT, TTYC_CUF1, cx - x0);
+		tty_move_try(tty, m, TTY_MOVE_ARGUMENT, TTYC_CUF, cx - x0);
+	}
+	tty_move_try(tty, m, TTY_MOVE_ARGUMENT, TTYC_HPA, cx);
+}
+
+/*
+ * Find the cheapest way to move the cursor between rows. Relative movement
+ * stops at the scroll region, so it can't be used to cross into or out of
+ * it.
+ */
+static void
+tty_move_row(struct tty *tty, u_int y0, u_int cy, struct tty_move *m)
+{
+	memset(m, 0, sizeof *m);
+	if (y0 == cy) {
+		m->type = TTY_MOVE_NONE;
+		return;
+	}
+	m->cost = UINT_MAX;
+
+	if (cy < y0) {
+		if (y0 < tty->rupper || cy >= tty->rupper) {
+			tty_move_try(tty, m, TTY_MOVE_REPEAT, TTYC_CUU1, y0 - cy);
+			tty_move_try(tty, m, TTY_MOVE_ARGUMENT, TTYC_CUU,
+			    y0 - cy);
+		}
+	} else {
+		if (y0 > tty->rlower || cy <= tty->rlower) {
+			tty_move_try(tty, m, TTY_MOVE_LINEFEED, 0, cy - y0);
+			tty_move_try(tty, m, TTY_MOVE_REPEAT, TTYC_CUD1, cy - y0);
+			tty_move_try(tty, m, TTY_MOVE_ARGUMENT, TTYC_CUD,
+			    cy - y0);
+		}
+	}
+	tty_move_try(tty, m, TTY_MOVE_ARGUMENT, TTYC_VPA, cy);
+}
+
+/* Write a cursor movement. */
+static void
+tty_move_write(struct tty *tty, const struct tty_move *m)
+{
+	struct grid		*gd = tty->shadow;
+	struct grid_cell	 gc;
+	u_int			 i;
+	int			 flags;
+
+	switch (m->type) {
+	case TTY_MOVE_NONE:
+		break;
+	case TTY_MOVE_REPEAT:
+		for (i = 0; i < m->n; i++)
+			tty_putcode(tty, m->code);
+		break;
+	case TTY_MOVE_ARGUMENT:
+		tty_putcode1(tty, m->code, m->n);
+		break;
+	case TTY_MOVE_LINEFEED:
+		for (i = 0; i < m->n; i++)
+			tty_putc(tty, '\n');
+		break;
+	case TTY_MOVE_OVERWRITE:
+		flags = tty->flags & TTY_SHADOW;
+		tty->flags |= TTY_SHADOW;
+		for (i = 0; i < m->n; i++) {
+			grid_view_get_cell(gd, tty->cx, tty->cy, &gc);
+			tty_putc(tty, *gc.data.data);
+		}
+		tty->flags = (tty->flags & ~TTY_SHADOW) | flags;
+		break;
+	}
+}
+
+/*
+ * Move the cursor. Each way of getting to the new position is costed from
+ * the terminal's own sequences and the shortest is used.
+ */
 void
 tty_cursor(struct tty *tty, u_int cx, u_int cy)
 {
 	struct tty_term	*term = tty->term;
-	u_int		 thisx, thisy;
-	int		 change;
+	struct tty_move	 row, column, from;
+	u_int		 thisx, thisy, cost, cup;
+	int		 cr = 0;
 
 	if (cx > tty->sx - 1)
 		cx = tty->sx - 1;
@@ -1587,114 +2443,344 @@ tty_cursor(struct tty *tty, u_int cx, u_int cy)
 	if (thisx > tty->sx - 1)
 		goto absolute;
 
+	cup = strlen(tty_term_string2(term, TTYC_CUP, cy, cx));
+
 	/* Move to home position (0, 0). */
 	if (cx == 0 && cy == 0 && tty_term_has(term, TTYC_HOME)) {
-		tty_putcode(tty, TTYC_HOME);
-		goto out;
+		cost = strlen(tty_term_string(term, TTYC_HOME));
+		if (cost <= cup) {
+			tty_putcode(tty, TTYC_HOME);
+			tty->client->cursor_saved += cup - cost;
+			goto out;
+		}
 	}
 
-	/* Zero on the next line. */
-	if (cx == 0 && cy == thisy + 1 && thisy != tty->rlower) {
+	/*
+	 * Move the row first, then the column, either directly or from the
+	 * left edge after a carriage return.
+	 */
+	tty_move_row(tty, thisy, cy, &row);
+	if (row.cost >= cup)
+		goto absolute;
+	if (cx == 0)
+		memset(&column, 0, sizeof column);
+	else
+		tty_move_column(tty, thisx, cx, cy, &column);
+	if (cx < thisx) {
+		tty_move_column(tty, 0, cx, cy, &from);
+		if (cx == 0 || from.cost < column.cost - 1) {
+			memcpy(&column, &from, sizeof column);
+			column.cost++;
+			cr = 1;
+		}
+	}
+	if (column.cost >= cup - row.cost)
+		goto absolute;
+	cost = row.cost + column.cost;
+
+	tty_move_write(tty, &row);
+	tty->cy = cy;
+	if (cr) {
 		tty_putc(tty, '\r');
-		tty_putc(tty, '\n');
-		goto out;
+		tty->cx = 0;
 	}
+	tty_move_write(tty, &column);
+	tty->client->cursor_saved += cup - cost;
+	goto out;
 
-	/* Moving column or row. */
-	if (cy == thisy) {
-		/*
-		 * Moving column only, row staying the same.
-		 */
+absolute:
+	/* Absolute movement. */
+	tty_putcode2(tty, TTYC_CUP, cy, cx);
 
-		/* To left edge. */
-		if (cx == 0) {
-			tty_putc(tty, '\r');
-			goto out;
-		}
+out:
+	tty->cx = cx;
+	tty->cy = cy;
+}
 
-		/* One to the left. */
-		if (cx == thisx - 1 && tty_term_has(term, TTYC_CUB1)) {
-			tty_putcode(tty, TTYC_CUB1);
-			goto out;
-		}
+static void
+tty_sgr_init(struct tty_sgr *sgr, struct tty *tty)
+{
+	sgr->tty = tty;
+	memcpy(&sgr->cell, &tty->cell, sizeof sgr->cell);
+	sgr->direct = 0;
 
-		/* One to the right. */
-		if (cx == thisx + 1 && tty_term_has(term, TTYC_CUF1)) {
-			tty_putcode(tty, TTYC_CUF1);
-			goto out;
-		}
+	sgr->used = 0;
+	sgr->overflow = 0;
 
-		/* Calculate difference. */
-		change = thisx - cx;	/* +ve left, -ve right */
+	sgr->nparams = 0;
+}
 
-		/*
-		 * Use HPA if change is larger than absolute, otherwise move
-		 * the cursor with CUB/CUF.
-		 */
-		if ((u_int) abs(change) > cx && tty_term_has(term, TTYC_HPA)) {
-			tty_putcode1(tty, TTYC_HPA, cx);
-			goto out;
-		} else if (change > 0 && tty_term_has(term, TTYC_CUB)) {
-			if (change == 2 && tty_term_has(term, TTYC_CUB1)) {
-				tty_putcode(tty, TTYC_CUB1);
-				tty_putcode(tty, TTYC_CUB1);
-				goto out;
-			}
-			tty_putcode1(tty, TTYC_CUB, change);
-			goto out;
-		} else if (change < 0 && tty_term_has(term, TTYC_CUF)) {
-			tty_putcode1(tty, TTYC_CUF, -change);
-			goto out;
-		}
-	} else if (cx == thisx) {
-		/*
-		 * Moving row only, column staying the same.
-		 */
+static void
+tty_sgr_out(struct tty_sgr *sgr, const char *buf, size_t len)
+{
+	if (sgr->direct) {
+		tty_add(sgr->tty, buf, len);
+		return;
+	}
+	if (sgr->overflow || len > sizeof sgr->out - sgr->used) {
+		sgr->overflow = 1;
+		return;
+	}
+	memcpy(sgr->out + sgr->used, buf, len);
+	sgr->used += len;
+}
 
-		/* One above. */
-		if (thisy != tty->rupper &&
-		    cy == thisy - 1 && tty_term_has(term, TTYC_CUU1)) {
-			tty_putcode(tty, TTYC_CUU1);
-			goto out;
-		}
+/* Write any parameters collected so far as one sequence. */
+static void
+tty_sgr_flush(struct tty_sgr *sgr)
+{
+	if (sgr->nparams == 0)
+		return;
+	tty_sgr_out(sgr, "\033[", 2);
+	tty_sgr_out(sgr, sgr->params, sgr->nparams);
+	tty_sgr_out(sgr, "m", 1);
+	sgr->nparams = 0;
+}
 
-		/* One below. */
-		if (thisy != tty->rlower &&
-		    cy == thisy + 1 && tty_term_has(term, TTYC_CUD1)) {
-			tty_putcode(tty, TTYC_CUD1);
-			goto out;
+static void
+tty_sgr_param(struct tty_sgr *sgr, const char *param, size_t len)
+{
+	/* An empty parameter is the same as zero. */
+	if (len == 0) {
+		param = "0";
+		len = 1;
+	}
+
+	if (sgr->nparams != 0 && sgr->nparams + 1 + len > sizeof sgr->params)
+		tty_sgr_flush(sgr);
+	if (len > sizeof sgr->params) {
+		tty_sgr_out(sgr, "\033[", 2);
+		tty_sgr_out(sgr, param, len);
+		tty_sgr_out(sgr, "m", 1);
+		return;
+	}
+
+	if (sgr->nparams != 0)
+		sgr->params[sgr->nparams++] = ';';
+	memcpy(sgr->params + sgr->nparams, param, len);
+	sgr->nparams += len;
+}
+
+/*
+ * Add a string from the terminal description. If it ends with an SGR
+ * sequence, the parameters are merged with any others around it; anything
+ * else is written as it is.
+ */
+static void
+tty_sgr_puts(struct tty_sgr *sgr, const char *s)
+{
+	const char	*csi, *cp;
+	size_t		 len;
+
+	len = strlen(s);
+	if (len == 0)
+		return;
+
+	csi = NULL;
+	if (s[len - 1] == 'm') {
+		for (cp = s; (cp = strstr(cp, "\033[")) != NULL; cp += 2)
+			csi = cp;
+	}
+	if (csi != NULL &&
+	    strspn(csi + 2, "0123456789;:") == (size_t)(s + len - 1 - csi - 2)) {
+		if (csi != s) {
+			tty_sgr_flush(sgr);
+			tty_sgr_out(sgr, s, csi - s);
 		}
+		tty_sgr_param(sgr, csi + 2, s + len - 1 - csi - 2);
+		return;
+	}
+
+	tty_sgr_flush(sgr);
+	tty_sgr_out(sgr, s, len);
+}
+
+static void
+tty_sgr_putcode(struct tty_sgr *sgr, enum tty_code_code code)
+{
+	tty_sgr_puts(sgr, tty_term_string(sgr->tty->term, code));
+}
+
+static void
+tty_sgr_putcode1(struct tty_sgr *sgr, enum tty_code_code code, int a)
+{
+	if (a < 0)
+		return;
+	tty_sgr_puts(sgr, tty_term_string1(sgr->tty->term, code, a));
+}
+
+static void
+tty_sgr_putcode3(struct tty_sgr *sgr, enum tty_code_code code, int a, int b,
+    int c)
+{
+	if (a < 0 || b < 0 || c < 0)
+		return;
+	tty_sgr_puts(sgr, tty_term_string3(sgr->tty->term, code, a, b, c));
+}
+
+static void
+tty_sgr_reset(struct tty_sgr *sgr)
+{
+	struct grid_cell	*gc = &sgr->cell;
+
+	if (!grid_cells_equal(gc, &grid_default_cell)) {
+		if ((gc->attr & GRID_ATTR_CHARSET) && tty_acs_needed(sgr->tty))
+			tty_sgr_putcode(sgr, TTYC_RMACS);
+		tty_sgr_putcode(sgr, TTYC_SGR0);
+		memcpy(gc, &grid_default_cell, sizeof *gc);
+	}
+}
+
+/*
+ * Get the SGR parameter to turn off an attribute. This is only known if the
+ * terminal uses the standard parameter to turn it on.
+ */
+static const char *
+tty_sgr_off(struct tty *tty, int attr)
+{
+	enum tty_code_code	 code;
+	const char		*s;
+	size_t			 len;
+	u_int			 i;
+
+	switch (attr) {
+	case GRID_ATTR_BRIGHT:
+		code = TTYC_BOLD;
+		break;
+	case GRID_ATTR_DIM:
+		code = TTYC_DIM;
+		break;
+	case GRID_ATTR_ITALICS:
+		code = tty_italics_code(tty);
+		break;
+	case GRID_ATTR_UNDERSCORE:
+		code = TTYC_SMUL;
+		break;
+	case GRID_ATTR_BLINK:
+		code = TTYC_BLINK;
+		break;
+	case GRID_ATTR_REVERSE:
+		if (tty_term_has(tty->term, TTYC_REV))
+			code = TTYC_REV;
+		else
+			code = TTYC_SMSO;
+		break;
+	case GRID_ATTR_HIDDEN:
+		code = TTYC_INVIS;
+		break;
+	case GRID_ATTR_STRIKETHROUGH:
+		code = TTYC_SMXX;
+		break;
+	default:
+		return (NULL);
+	}
+
+	s = tty_term_string(tty->term, code);
+	if (strncmp(s, "\033[", 2) != 0)
+		return (NULL);
+	s += 2;
+	len = strlen(s);
+	for (i = 0; i < nitems(tty_sgr_attrs); i++) {
+		if (len == strlen(tty_sgr_attrs[i].on) + 1 &&
+		    strncmp(s, tty_sgr_attrs[i].on, len - 1) == 0 &&
+		    s[len - 1] == 'm')
+			return (tty_sgr_attrs[i].off);
+	}
+	return (NULL);
+}
+
+/*
+ * Turn off attributes not in attr without resetting. Returns -1 if this is
+ * not possible. The parameters to turn attributes off are only used if the
+ * terminal claims to support ECMA-48 default colours, the same as for 39 and
+ * 49 in tty_colours().
+ */
+static int
+tty_sgr_clear(struct tty_sgr *sgr, int attr)
+{
+	struct tty	*tty = sgr->tty;
+	int		 cleared;
+	const char	*off, *other;
+	char		 s[16];
+	u_int		 i, j;
 
-		/* Calculate difference. */
-		change = thisy - cy;	/* +ve up, -ve down */
+	cleared = sgr->cell.attr & ~attr;
+	if (cleared == 0)
+		return (0);
+	if (!tty_term_flag(tty->term, TTYC_AX))
+		return (-1);
+
+	for (i = 0; i < nitems(tty_sgr_attrs); i++) {
+		if (~cleared & tty_sgr_attrs[i].attr)
+			continue;
+		if (~sgr->cell.attr & tty_sgr_attrs[i].attr)
+			continue;
+		if ((off = tty_sgr_off(tty, tty_sgr_attrs[i].attr)) == NULL)
+			return (-1);
+		xsnprintf(s, sizeof s, "\033[%sm", off);
+		tty_sgr_puts(sgr, s);
 
 		/*
-		 * Try to use VPA if change is larger than absolute or if this
-		 * change would cross the scroll region, otherwise use CUU/CUD.
+		 * This may turn off others as well, either because they share
+		 * a parameter (22 is bold and dim) or because the terminal
+		 * uses the same sequence for both.
 		 */
-		if ((u_int) abs(change) > cy ||
-		    (change < 0 && cy - change > tty->rlower) ||
-		    (change > 0 && cy - change < tty->rupper)) {
-			    if (tty_term_has(term, TTYC_VPA)) {
-				    tty_putcode1(tty, TTYC_VPA, cy);
-				    goto out;
-			    }
-		} else if (change > 0 && tty_term_has(term, TTYC_CUU)) {
-			tty_putcode1(tty, TTYC_CUU, change);
-			goto out;
-		} else if (change < 0 && tty_term_has(term, TTYC_CUD)) {
-			tty_putcode1(tty, TTYC_CUD, -change);
-			goto out;
+		for (j = 0; j < nitems(tty_sgr_attrs); j++) {
+			other = tty_sgr_off(tty, tty_sgr_attrs[j].attr);
+			if (other != NULL && strcmp(other, off) == 0)
+				sgr->cell.attr &= ~tty_sgr_attrs[j].attr;
 		}
 	}
+	if (cleared & GRID_ATTR_CHARSET) {
+		if (tty_acs_needed(tty))
+			tty_sgr_putcode(sgr, TTYC_RMACS);
+		sgr->cell.attr &= ~GRID_ATTR_CHARSET;
+	}
+	return (0);
+}
 
-absolute:
-	/* Absolute movement. */
-	tty_putcode2(tty, TTYC_CUP, cy, cx);
+/* Turn on colours and attributes in gc. */
+static void
+tty_sgr_set(struct tty_sgr *sgr, const struct grid_cell *gc)
+{
+	struct tty	*tty = sgr->tty;
+	int		 changed;
 
-out:
-	tty->cx = cx;
-	tty->cy = cy;
+	/*
+	 * Set the colours. This may reset (so it comes first) and may add to
+	 * (NOT remove) the desired attributes.
+	 */
+	tty_colours(sgr, gc);
+
+	/* Filter out attribute bits already set. */
+	changed = gc->attr & ~sgr->cell.attr;
+	sgr->cell.attr = gc->attr;
+
+	/* Set the attributes. */
+	if (changed & GRID_ATTR_BRIGHT)
+		tty_sgr_putcode(sgr, TTYC_BOLD);
+	if (changed & GRID_ATTR_DIM)
+		tty_sgr_putcode(sgr, TTYC_DIM);
+	if (changed & GRID_ATTR_ITALICS)
+		tty_sgr_putcode(sgr, tty_italics_code(tty));
+	if (changed & GRID_ATTR_UNDERSCORE)
+		tty_sgr_putcode(sgr, TTYC_SMUL);
+	if (changed & GRID_ATTR_BLINK)
+		tty_sgr_putcode(sgr, TTYC_BLINK);
+	if (changed & GRID_ATTR_REVERSE) {
+		if (tty_term_has(tty->term, TTYC_REV))
+			tty_sgr_putcode(sgr, TTYC_REV);
+		else if (tty_term_has(tty->term, TTYC_SMSO))
+			tty_sgr_putcode(sgr, TTYC_SMSO);
+	}
+	if (changed & GRID_ATTR_HIDDEN)
+		tty_sgr_putcode(sgr, TTYC_INVIS);
+	if (changed & GRID_ATTR_STRIKETHROUGH)
+		tty_sgr_putcode(sgr, TTYC_SMXX);
+	if ((changed & GRID_ATTR_CHARSET) && tty_acs_needed(tty))
+		tty_sgr_putcode(sgr, TTYC_SMACS);
+
+	tty_sgr_flush(sgr);
 }
 
 void
@@ -1702,7 +2788,7 @@ tty_attributes(struct tty *tty, const struct grid_cell *gc,
     const struct window_pane *wp)
 {
 	struct grid_cell	*tc = &tty->cell, gc2;
-	int			 changed;
+	struct tty_sgr		 change, reset, *sgr;
 
 	/* Ignore cell if it is the same as the last one. */
 	if (wp != NULL &&
@@ -1739,49 +2825,45 @@ tty_attributes(struct tty *tty, const struct grid_cell *gc,
 	tty_check_fg(tty, wp, &gc2);
 	tty_check_bg(tty, wp, &gc2);
 
-	/* If any bits are being cleared, reset everything. */
-	if (tc->attr & ~gc2.attr)
-		tty_reset(tty);
-
 	/*
-	 * Set the colours. This may call tty_reset() (so it comes next) and
-	 * may add to (NOT remove) the desired attributes by changing new_attr.
+	 * Work out the changes needed without resetting. If anything must be
+	 * turned off, also work out the changes after a reset and use
+	 * whichever is shorter.
 	 */
-	tty_colours(tty, &gc2);
-
-	/* Filter out attribute bits already set. */
-	changed = gc2.attr & ~tc->attr;
-	tc->attr = gc2.attr;
-
-	/* Set the attributes. */
-	if (changed & GRID_ATTR_BRIGHT)
-		tty_putcode(tty, TTYC_BOLD);
-	if (changed & GRID_ATTR_DIM)
-		tty_putcode(tty, TTYC_DIM);
-	if (changed & GRID_ATTR_ITALICS)
-		tty_set_italics(tty);
-	if (changed & GRID_ATTR_UNDERSCORE)
-		tty_putcode(tty, TTYC_SMUL);
-	if (changed & GRID_ATTR_BLINK)
-		tty_putcode(tty, TTYC_BLINK);
-	if (changed & GRID_ATTR_REVERSE) {
-		if (tty_term_has(tty->term, TTYC_REV))
-			tty_putcode(tty, TTYC_REV);
-		else if (tty_term_has(tty->term, TTYC_SMSO))
-			tty_putcode(tty, TTYC_SMSO);
+	sgr = NULL;
+	tty_sgr_init(&change, tty);
+	if (tty_sgr_clear(&change, gc2.attr) == 0) {
+		tty_sgr_set(&change, &gc2);
+		if (!change.overflow)
+			sgr = &change;
 	}
-	if (changed & GRID_ATTR_HIDDEN)
-		tty_putcode(tty, TTYC_INVIS);
-	if (changed & GRID_ATTR_STRIKETHROUGH)
-		tty_putcode(tty, TTYC_SMXX);
-	if ((changed & GRID_ATTR_CHARSET) && tty_acs_needed(tty))
-		tty_putcode(tty, TTYC_SMACS);
+	if ((tc->attr & ~gc2.attr) ||
+	    (gc2.fg == 8 && tc->fg != 8) ||
+	    (gc2.bg == 8 && tc->bg != 8)) {
+		tty_sgr_init(&reset, tty);
+		tty_sgr_reset(&reset);
+		tty_sgr_set(&reset, &gc2);
+		if (!reset.overflow && (sgr == NULL || reset.used < sgr->used))
+			sgr = &reset;
+	}
+
+	/* If it is too long to collect, write it out directly. */
+	if (sgr == NULL) {
+		sgr = &reset;
+		tty_sgr_init(sgr, tty);
+		sgr->direct = 1;
+		tty_sgr_reset(sgr);
+		tty_sgr_set(sgr, &gc2);
+	} else if (sgr->used != 0)
+		tty_add(tty, sgr->out, sgr->used);
+	memcpy(tc, &sgr->cell, sizeof *tc);
 }
 
 static void
-tty_colours(struct tty *tty, const struct grid_cell *gc)
+tty_colours(struct tty_sgr *sgr, const struct grid_cell *gc)
 {
-	struct grid_cell	*tc = &tty->cell;
+	struct tty		*tty = sgr->tty;
+	struct grid_cell	*tc = &sgr->cell;
 	int			 have_ax;
 
 	/* No changes? Nothing is necessary. */
@@ -1804,20 +2886,20 @@ tty_colours(struct tty *tty, const struct grid_cell *gc)
 		 */
 		have_ax = tty_term_flag(tty->term, TTYC_AX);
 		if (!have_ax && tty_term_has(tty->term, TTYC_OP))
-			tty_reset(tty);
+			tty_sgr_reset(sgr);
 		else {
 			if (gc->fg == 8 && tc->fg != 8) {
 				if (have_ax)
-					tty_puts(tty, "\033[39m");
+					tty_sgr_puts(sgr, "\033[39m");
 				else if (tc->fg != 7)
-					tty_putcode1(tty, TTYC_SETAF, 7);
+					tty_sgr_putcode1(sgr, TTYC_SETAF, 7);
 				tc->fg = 8;
 			}
 			if (gc->bg == 8 && tc->bg != 8) {
 				if (have_ax)
-					tty_puts(tty, "\033[49m");
+					tty_sgr_puts(sgr, "\033[49m");
 				else if (tc->bg != 0)
-					tty_putcode1(tty, TTYC_SETAB, 0);
+					tty_sgr_putcode1(sgr, TTYC_SETAB, 0);
 				tc->bg = 8;
 			}
 		}
@@ -1825,14 +2907,14 @@ tty_colours(struct tty *tty, const struct grid_cell *gc)
 
 	/* Set the foreground colour. */
 	if (gc->fg != 8 && gc->fg != tc->fg)
-		tty_colours_fg(tty, gc);
+		tty_colours_fg(sgr, gc);
 
 	/*
 	 * Set the background colour. This must come after the foreground as
 	 * tty_colour_fg() can call tty_reset().
 	 */
 	if (gc->bg != 8 && gc->bg != tc->bg)
-		tty_colours_bg(tty, gc);
+		tty_colours_bg(sgr, gc);
 }
 
 static void
@@ -1950,15 +3032,15 @@ tty_check_bg(struct tty *tty, const struct window_pane *wp,
 }
 
 static void
-tty_colours_fg(struct tty *tty, const struct grid_cell *gc)
+tty_colours_fg(struct tty_sgr *sgr, const struct grid_cell *gc)
 {
-	struct grid_cell	*tc = &tty->cell;
+	struct grid_cell	*tc = &sgr->cell;
 	char			 s[32];
 
 	/* Is this a 24-bit or 256-colour colour? */
 	if (gc->fg & COLOUR_FLAG_RGB ||
 	    gc->fg & COLOUR_FLAG_256) {
-		if (tty_try_colour(tty, gc->fg, "38") == 0)
+		if (tty_try_colour(sgr, gc->fg, "38") == 0)
 			goto save_fg;
 		/* Should not get here, already converted in tty_check_fg. */
 		return;
@@ -1967,12 +3049,12 @@ tty_colours_fg(struct tty *tty, const struct grid_cell *gc)
 	/* Is this an aixterm bright colour? */
 	if (gc->fg >= 90 && gc->fg <= 97) {
 		xsnprintf(s, sizeof s, "\033[%dm", gc->fg);
-		tty_puts(tty, s);
+		tty_sgr_puts(sgr, s);
 		goto save_fg;
 	}
 
 	/* Otherwise set the foreground colour. */
-	tty_putcode1(tty, TTYC_SETAF, gc->fg);
+	tty_sgr_putcode1(sgr, TTYC_SETAF, gc->fg);
 
 save_fg:
 	/* Save the new values in the terminal current cell. */
@@ -1980,15 +3062,15 @@ save_fg:
 }
 
 static void
-tty_colours_bg(struct tty *tty, const struct grid_cell *gc)
+tty_colours_bg(struct tty_sgr *sgr, const struct grid_cell *gc)
 {
-	struct grid_cell	*tc = &tty->cell;
+	struct grid_cell	*tc = &sgr->cell;
 	char			 s[32];
 
 	/* Is this a 24-bit or 256-colour colour? */
 	if (gc->bg & COLOUR_FLAG_RGB ||
 	    gc->bg & COLOUR_FLAG_256) {
-		if (tty_try_colour(tty, gc->bg, "48") == 0)
+		if (tty_try_colour(sgr, gc->bg, "48") == 0)
 			goto save_bg;
 		/* Should not get here, already converted in tty_check_bg. */
 		return;
@@ -1997,12 +3079,12 @@ tty_colours_bg(struct tty *tty, const struct grid_cell *gc)
 	/* Is this an aixterm bright colour? */
 	if (gc->bg >= 90 && gc->bg <= 97) {
 		xsnprintf(s, sizeof s, "\033[%dm", gc->bg + 10);
-		tty_puts(tty, s);
+		tty_sgr_puts(sgr, s);
 		goto save_bg;
 	}
 
 	/* Otherwise set the background colour. */
-	tty_putcode1(tty, TTYC_SETAB, gc->bg);
+	tty_sgr_putcode1(sgr, TTYC_SETAB, gc->bg);
 
 save_bg:
 	/* Save the new values in the terminal current cell. */
@@ -2010,10 +3092,11 @@ save_bg:
 }
 
 static int
-tty_try_colour(struct tty *tty, int colour, const char *type)
+tty_try_colour(struct tty_sgr *sgr, int colour, const char *type)
 {
-	u_char	r, g, b;
-	char	s[32];
+	struct tty	*tty = sgr->tty;
+	u_char		 r, g, b;
+	char		 s[32];
 
 	if (colour & COLOUR_FLAG_256) {
 		/*
@@ -2032,11 +3115,11 @@ tty_try_colour(struct tty *tty, int colour, const char *type)
 			if (*type == '3') {
 				if (!tty_term_has(tty->term, TTYC_SETAF))
 					goto fallback_256;
-				tty_putcode1(tty, TTYC_SETAF, colour & 0xff);
+				tty_sgr_putcode1(sgr, TTYC_SETAF, colour & 0xff);
 			} else {
 				if (!tty_term_has(tty->term, TTYC_SETAB))
 					goto fallback_256;
-				tty_putcode1(tty, TTYC_SETAB, colour & 0xff);
+				tty_sgr_putcode1(sgr, TTYC_SETAB, colour & 0xff);
 			}
 			return (0);
 		}
@@ -2048,12 +3131,12 @@ tty_try_colour(struct tty *tty, int colour, const char *type)
 			if (!tty_term_has(tty->term, TTYC_SETRGBF))
 				return (-1);
 			colour_split_rgb(colour & 0xffffff, &r, &g, &b);
-			tty_putcode3(tty, TTYC_SETRGBF, r, g, b);
+			tty_sgr_putcode3(sgr, TTYC_SETRGBF, r, g, b);
 		} else {
 			if (!tty_term_has(tty->term, TTYC_SETRGBB))
 				return (-1);
 			colour_split_rgb(colour & 0xffffff, &r, &g, &b);
-			tty_putcode3(tty, TTYC_SETRGBB, r, g, b);
+			tty_sgr_putcode3(sgr, TTYC_SETRGBB, r, g, b);
 		}
 		return (0);
 	}
@@ -2062,7 +3145,7 @@ tty_try_colour(struct tty *tty, int colour, const char *type)
 
 fallback_256:
 	xsnprintf(s, sizeof s, "\033[%s;5;%dm", type, colour & 0xff);
-	tty_puts(tty, s);
+	tty_sgr_puts(sgr, s);
 	return (0);
 }
 
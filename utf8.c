@@ -26,6 +26,15 @@
 #include "tmux.h"
 
 static int	utf8_width(wchar_t);
+static int	utf8_width_lookup(wchar_t);
+
+/*
+ * Cache of character widths, in pages of 256 code points allocated when first
+ * used. An entry is zero if not yet looked up, one if the character has no
+ * width, otherwise the width plus two.
+ */
+#define UTF8_WIDTH_PAGES (0x110000 / 256)
+static u_char	*utf8_width_cache[UTF8_WIDTH_PAGES];
 
 /* Set a single character. */
 void
@@ -103,9 +112,92 @@ utf8_append(struct utf8_data *ud, u_char ch)
 	return (UTF8_DONE);
 }
 
-/* Get width of Unicode character. */
+/*
+ * Decode one UTF-8 character from the start of a buffer. Returns UTF8_MORE if
+ * the buffer does not start with a complete, well-formed character, in which
+ * case the caller should fall back to utf8_open and utf8_append. Otherwise
+ * sets size and returns UTF8_DONE, or UTF8_ERROR if the character cannot be
+ * printed and should be skipped.
+ *
+ * Well-formed means the byte ranges in table 3-7 of the Unicode standard, so
+ * overlong forms, surrogates and code points above U+10FFFF are rejected.
+ */
+enum utf8_state
+utf8_decode(struct utf8_data *ud, const u_char *buf, size_t len)
+{
+	wchar_t	wc;
+	u_char	ch = buf[0];
+	int	width;
+
+	if (ch >= 0xc2 && ch <= 0xdf) {
+		if (len < 2 || (buf[1] & 0xc0) != 0x80)
+			return (UTF8_MORE);
+		wc = ((ch & 0x1f) << 6) | (buf[1] & 0x3f);
+		ud->size = 2;
+	} else if (ch >= 0xe0 && ch <= 0xef) {
+		if (len < 3 || (buf[1] & 0xc0) != 0x80 ||
+		    (buf[2] & 0xc0) != 0x80)
+			return (UTF8_MORE);
+		if ((ch == 0xe0 && buf[1] < 0xa0) ||
+		    (ch == 0xed && buf[1] > 0x9f))
+			return (UTF8_MORE);
+		wc = ((ch & 0x0f) << 12) | ((buf[1] & 0x3f) << 6) |
+		    (buf[2] & 0x3f);
+		ud->size = 3;
+	} else if (ch >= 0xf0 && ch <= 0xf4) {
+		if (len < 4 || (buf[1] & 0xc0) != 0x80 ||
+		    (buf[2] & 0xc0) != 0x80 || (buf[3] & 0xc0) != 0x80)
+			return (UTF8_MORE);
+		if ((ch == 0xf0 && buf[1] < 0x90) ||
+		    (ch == 0xf4 && buf[1] > 0x8f))
+			return (UTF8_MORE);
+		wc = ((ch & 0x07) << 18) | ((buf[1] & 0x3f) << 12) |
+		    ((buf[2] & 0x3f) << 6) | (buf[3] & 0x3f);
+		ud->size = 4;
+	} else
+		return (UTF8_MORE);
+
+	memcpy(ud->data, buf, ud->size);
+	memset(ud->data + ud->size, 0, (sizeof ud->data) - ud->size);
+	ud->have = ud->size;
+
+	if ((width = utf8_width(wc)) < 0) {
+		ud->width = 0xff;
+		return (UTF8_ERROR);
+	}
+	ud->width = width;
+	return (UTF8_DONE);
+}
+
+/* Get width of Unicode character, from the cache if possible. */
 static int
 utf8_width(wchar_t wc)
+{
+	u_char	*page;
+	int	 width;
+
+	if (wc < 0 || wc >= UTF8_WIDTH_PAGES * 256)
+		return (utf8_width_lookup(wc));
+
+	page = utf8_width_cache[wc / 256];
+	if (page == NULL) {
+		page = xcalloc(1, 256);
+		utf8_width_cache[wc / 256] = page;
+	}
+	if (page[wc % 256] != 0)
+		return ((int)page[wc % 256] - 2);
+
+	width = utf8_width_lookup(wc);
+	if (width < 0)
+		page[wc % 256] = 1;
+	else if (width <= 0xff - 2)
+		page[wc % 256] = width + 2;
+	return (width);
+}
+
+/* Look up width of Unicode character. */
+static int
+utf8_width_lookup(wchar_t wc)
 {
 	int	width;
 
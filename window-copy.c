@@ -81,6 +81,7 @@ static void	window_copy_copy_line(struct window_pane *, char **, size_t *,
 static int	window_copy_in_set(struct window_pane *, u_int, u_int,
 		    const char *);
 static u_int	window_copy_find_length(struct window_pane *, u_int);
+static void	window_copy_cursor_line(struct window_pane *, u_int);
 static void	window_copy_cursor_start_of_line(struct window_pane *);
 static void	window_copy_cursor_back_to_indentation(struct window_pane *);
 static void	window_copy_cursor_end_of_line(struct window_pane *);
@@ -247,6 +248,7 @@ window_copy_init_from_pane(struct window_pane *wp, int scroll_exit)
 		fatalx("not in copy mode");
 
 	data->backing = &wp->base;
+	grid_reflow_finish(data->backing->grid);
 	data->cx = data->backing->cx;
 	data->cy = data->backing->cy;
 	data->scroll_exit = scroll_exit;
@@ -276,8 +278,13 @@ window_copy_free(struct window_pane *wp)
 {
 	struct window_copy_mode_data	*data = wp->modedata;
 
-	if (wp->fd != -1)
-		bufferevent_enable(wp->event, EV_READ|EV_WRITE);
+	/* If the read rate limit has also stopped reading, leave it to that. */
+	if (wp->fd != -1) {
+		if (wp->flags & PANE_RATELIMITED)
+			bufferevent_enable(wp->event, EV_WRITE);
+		else
+			bufferevent_enable(wp->event, EV_READ|EV_WRITE);
+	}
 
 	free(data->searchmark);
 	free(data->searchstr);
@@ -993,6 +1000,63 @@ window_copy_search_compare(struct grid *gd, u_int px, u_int py,
 	return (memcmp(ud->data, sud->data, ud->size) == 0);
 }
 
+/*
+ * Search line py for the text in sgd as plain bytes, which can be done if the
+ * line and the text have only single byte characters. Returns -1 if not,
+ * otherwise 1 if found and 0 if not found.
+ */
+static int
+window_copy_search_text(struct grid *gd, struct grid *sgd, u_int *ppx,
+    u_int py, u_int first, u_int last, int cis, int reverse)
+{
+	static u_char	*line, *text;
+	static u_int	 linesize, textsize;
+	u_int		 n = sgd->sx, ax, bx, px;
+	u_char		 c;
+
+	if (n == 0)
+		return (-1);
+	if (gd->sx > linesize) {
+		line = xrealloc(line, gd->sx);
+		linesize = gd->sx;
+	}
+	if (n > textsize) {
+		text = xrealloc(text, n);
+		textsize = n;
+	}
+	if (!grid_line_chars(sgd, 0, 0, n, text))
+		return (-1);
+	if (!grid_line_chars(gd, 0, py, gd->sx, line))
+		return (-1);
+	if (n > gd->sx)
+		return (0);
+
+	/*
+	 * The text must fit on the line and, as when comparing cells, may not
+	 * end in the last cell when going left to right.
+	 */
+	if (last > gd->sx - n)
+		last = gd->sx - n;
+	if (reverse)
+		last++;
+
+	for (ax = first; ax < last; ax++) {
+		px = reverse ? last - 1 - (ax - first) : ax;
+		for (bx = 0; bx < n; bx++) {
+			c = line[px + bx];
+			if (cis)
+				c = tolower(c);
+			if (c != text[bx])
+				break;
+		}
+		if (bx == n) {
+			*ppx = px;
+			return (1);
+		}
+	}
+	return (0);
+}
+
 static int
 window_copy_search_lr(struct grid *gd,
     struct grid *sgd, u_int *ppx, u_int py, u_int first, u_int last, int cis)
@@ -1000,6 +1064,11 @@ window_copy_search_lr(struct grid *gd,
 	u_int	ax, bx, px;
 	int	matched;
 
+	matched = window_copy_search_text(gd, sgd, ppx, py, first, last, cis,
+	    0);
+	if (matched != -1)
+		return (matched);
+
 	for (ax = first; ax < last; ax++) {
 		if (ax + sgd->sx >= gd->sx)
 			break;
@@ -1025,6 +1094,11 @@ window_copy_search_rl(struct grid *gd,
 	u_int	ax, bx, px;
 	int	matched;
 
+	matched = window_copy_search_text(gd, sgd, ppx, py, first, last, cis,
+	    1);
+	if (matched != -1)
+		return (matched);
+
 	for (ax = last + 1; ax > first; ax--) {
 		if (gd->sx - (ax - 1) < sgd->sx)
 			continue;
@@ -1716,7 +1790,7 @@ window_copy_copy_line(struct window_pane *wp, char **buf, size_t *off, u_int sy,
 	struct window_copy_mode_data	*data = wp->modedata;
 	struct grid			*gd = data->backing->grid;
 	struct grid_cell		 gc;
-	struct grid_line		*gl;
+	const struct grid_line		*gl;
 	struct utf8_data		 ud;
 	u_int				 i, xx, wrapped = 0;
 	const char			*s;
@@ -1728,7 +1802,7 @@ window_copy_copy_line(struct window_pane *wp, char **buf, size_t *off, u_int sy,
 	 * Work out if the line was wrapped at the screen edge and all of it is
 	 * on screen.
 	 */
-	gl = &gd->linedata[sy];
+	gl = grid_peek_line(gd, sy);
 	if (gl->flags & GRID_LINE_WRAPPED && gl->cellsize <= gd->sx)
 		wrapped = 1;
 
@@ -1816,7 +1890,7 @@ window_copy_find_length(struct window_pane *wp, u_int py)
 	 * width of the grid, and screen_write_copy treats them as spaces, so
 	 * ignore them here too.
 	 */
-	px = s->grid->linedata[py].cellsize;
+	px = grid_peek_line(s->grid, py)->cellsize;
 	if (px > screen_size_x(s))
 		px = screen_size_x(s);
 	while (px > 0) {
@@ -1828,6 +1902,47 @@ window_copy_find_length(struct window_pane *wp, u_int py)
 	return (px);
 }
 
+/*
+ * Move the cursor to line py of the backing screen, scrolling so it is at the
+ * top or bottom if it is not visible. The remembered column is updated as if
+ * the cursor had been moved up or down a line at a time.
+ */
+static void
+window_copy_cursor_line(struct window_pane *wp, u_int py)
+{
+	struct window_copy_mode_data	*data = wp->modedata;
+	struct screen			*back_s = data->backing;
+	struct screen			*s = &data->screen;
+	u_int				 top, oy, ox, sy = screen_size_y(s);
+
+	top = screen_hsize(back_s) - data->oy;
+	oy = top + data->cy;
+	if (py == oy)
+		return;
+
+	ox = window_copy_find_length(wp, oy);
+	if (data->cx != ox) {
+		data->lastcx = data->cx;
+		data->lastsx = ox;
+	}
+	if (py + 1 < oy || py > oy + 1) {
+		ox = window_copy_find_length(wp, py < oy ? py + 1 : py - 1);
+		if (data->lastcx < data->lastsx && data->lastcx < ox)
+			data->lastsx = ox;
+	}
+
+	if (py < top) {
+		data->oy = screen_hsize(back_s) - py;
+		data->cy = 0;
+	} else if (py >= top + sy) {
+		data->oy = screen_hsize(back_s) + sy - 1 - py;
+		data->cy = sy - 1;
+	} else
+		data->cy = py - top;
+	window_copy_update_selection(wp, 1);
+	window_copy_redraw_screen(wp);
+}
+
 static void
 window_copy_cursor_start_of_line(struct window_pane *wp)
 {
@@ -1835,15 +1950,12 @@ window_copy_cursor_start_of_line(struct window_pane *wp)
 	struct screen			*back_s = data->backing;
 	struct screen			*s = &data->screen;
 	struct grid			*gd = back_s->grid;
-	u_int				 py;
+	u_int				 py, first;
 
 	if (data->cx == 0 && s->sel.lineflag == LINE_SEL_NONE) {
 		py = screen_hsize(back_s) + data->cy - data->oy;
-		while (py > 0 &&
-		    gd->linedata[py-1].flags & GRID_LINE_WRAPPED) {
-			window_copy_cursor_up(wp, 0);
-			py = screen_hsize(back_s) + data->cy - data->oy;
-		}
+		grid_wrapped_lines(gd, py, &first, NULL);
+		window_copy_cursor_line(wp, first);
 	}
 	window_copy_update_cursor(wp, 0, data->cy);
 	if (window_copy_update_selection(wp, 1))
@@ -1880,7 +1992,7 @@ window_copy_cursor_end_of_line(struct window_pane *wp)
 	struct screen			*back_s = data->backing;
 	struct screen			*s = &data->screen;
 	struct grid			*gd = back_s->grid;
-	u_int				 px, py;
+	u_int				 px, py, last;
 
 	py = screen_hsize(back_s) + data->cy - data->oy;
 	px = window_copy_find_length(wp, py);
@@ -1888,14 +2000,10 @@ window_copy_cursor_end_of_line(struct window_pane *wp)
 	if (data->cx == px && s->sel.lineflag == LINE_SEL_NONE) {
 		if (data->screen.sel.flag && data->rectflag)
 			px = screen_size_x(back_s);
-		if (gd->linedata[py].flags & GRID_LINE_WRAPPED) {
-			while (py < gd->sy + gd->hsize &&
-			    gd->linedata[py].flags & GRID_LINE_WRAPPED) {
-				window_copy_cursor_down(wp, 0);
-				py = screen_hsize(back_s)
-				     + data->cy - data->oy;
-			}
-			px = window_copy_find_length(wp, py);
+		grid_wrapped_lines(gd, py, NULL, &last);
+		if (last != py) {
+			window_copy_cursor_line(wp, last);
+			px = window_copy_find_length(wp, last);
 		}
 	}
 	window_copy_update_cursor(wp, px, data->cy);
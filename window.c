@@ -51,6 +51,15 @@
  * it reaches zero.
  */
 
+/* Microseconds to spend reflowing pending history before letting others run. */
+#define WINDOW_REFLOW_TIME 5000
+
+/* Microseconds to wait for more output from a busy pane before parsing. */
+#define WINDOW_READ_TIME 1000
+
+/* Microseconds over which the read rate limit is applied. */
+#define WINDOW_RATE_TIME 100000
+
 /* Global window list. */
 struct windows windows;
 
@@ -67,8 +76,25 @@ static struct window_pane *window_pane_create(struct window *, u_int, u_int,
 static void	window_pane_destroy(struct window_pane *);
 
 static void	window_pane_read_callback(struct bufferevent *, void *);
+static void	window_pane_read_timer(int, short, void *);
+static void	window_pane_read_parse(struct window_pane *);
+static void	window_pane_rate_timer(int, short, void *);
+static void	window_pane_rate_limit(struct window_pane *, size_t);
 static void	window_pane_error_callback(struct bufferevent *, short, void *);
 
+static struct event window_history_timer;
+
+static int	window_history_cmp(const void *, const void *);
+static void	window_history_trim(void);
+static void	window_history_timer_callback(int, short, void *);
+
+static struct event window_reflow_timer;
+static u_int	window_reflow_last;
+
+static struct window_pane *window_reflow_next_pane(void);
+static void	window_reflow_timer_callback(int, short, void *);
+static void	window_pane_reflow(struct window_pane *);
+
 static int	winlink_next_index(struct winlinks *, int);
 
 static struct window_pane *window_pane_choose_best(struct window_pane **,
@@ -299,6 +325,212 @@ window_update_activity(struct window *w)
 	alerts_queue(w, WINDOW_ACTIVITY);
 }
 
+/* Get the total bytes of history in all panes. */
+unsigned long long
+window_history_total_bytes(void)
+{
+	struct window_pane	*wp;
+	unsigned long long	 total = 0;
+	size_t			 raw, compressed;
+
+	RB_FOREACH(wp, window_pane_tree, &all_window_panes) {
+		grid_history_bytes(wp->base.grid, &raw, &compressed);
+		total += raw + compressed;
+	}
+	return (total);
+}
+
+/* Sort panes by when they were last used, oldest first. */
+static int
+window_history_cmp(const void *a, const void *b)
+{
+	struct window_pane	*wpa = *(struct window_pane **)a;
+	struct window_pane	*wpb = *(struct window_pane **)b;
+
+	if (timercmp(&wpa->used_time, &wpb->used_time, <))
+		return (-1);
+	if (timercmp(&wpa->used_time, &wpb->used_time, >))
+		return (1);
+	return (0);
+}
+
+/*
+ * Bring history memory under history-memory-limit. Compress the history of the
+ * least recently used panes first and, if that is not enough, trim it.
+ */
+static void
+window_history_trim(void)
+{
+	struct client		 *c;
+	struct window_pane	 *wp, **list;
+	struct grid		 *gd;
+	struct timeval		  tv;
+	unsigned long long	  limit, total, before, after, excess;
+	size_t			  raw, compressed;
+	u_int			  n, i, lines;
+
+	limit = options_get_number(global_options, "history-memory-limit");
+	limit *= 1024;
+	total = window_history_total_bytes();
+	if (limit == 0 || total <= limit)
+		return;
+	log_debug("history is %llu bytes, limit %llu", total, limit);
+
+	/* Panes on screen count as just viewed. */
+	gettimeofday(&tv, NULL);
+	TAILQ_FOREACH(c, &clients, entry) {
+		if (c->session == NULL)
+			continue;
+		TAILQ_FOREACH(wp, &c->session->curw->window->panes, entry)
+			memcpy(&wp->used_time, &tv, sizeof wp->used_time);
+	}
+
+	list = NULL;
+	n = 0;
+	RB_FOREACH(wp, window_pane_tree, &all_window_panes) {
+		list = xreallocarray(list, n + 1, sizeof *list);
+		list[n++] = wp;
+	}
+	qsort(list, n, sizeof *list, window_history_cmp);
+
+	for (i = 0; i < n && total > limit; i++) {
+		gd = list[i]->base.grid;
+
+		grid_history_bytes(gd, &raw, &compressed);
+		before = raw + compressed;
+		grid_compress_all_history(gd);
+		grid_history_bytes(gd, &raw, &compressed);
+		after = raw + compressed;
+
+		total = total - before + after;
+	}
+
+	for (i = 0; i < n && total > limit; i++) {
+		wp = list[i];
+		gd = wp->base.grid;
+		lines = gd->hsize;
+		if (gd->pending != NULL)
+			lines += gd->pending->hsize;
+		if (wp->mode != NULL || lines == 0)
+			continue;
+
+		grid_history_bytes(gd, &raw, &compressed);
+		before = raw + compressed;
+		excess = total - limit;
+		if (excess < before)
+			lines = (excess * lines + before - 1) / before;
+		log_debug("%%%u trimming %u history lines", wp->id, lines);
+		grid_trim_history(gd, lines);
+		grid_history_bytes(gd, &raw, &compressed);
+		after = raw + compressed;
+
+		total = total - before + after;
+	}
+
+	free(list);
+}
+
+/* Check history memory every second while there is a limit. */
+static void
+window_history_timer_callback(__unused int fd, __unused short events,
+    __unused void *arg)
+{
+	window_history_trim();
+	window_history_timer_start();
+}
+
+/* Start or stop the history memory timer when the limit changes. */
+void
+window_history_timer_start(void)
+{
+	struct timeval	tv = { .tv_sec = 1 };
+
+	if (!event_initialized(&window_history_timer)) {
+		evtimer_set(&window_history_timer,
+		    window_history_timer_callback, NULL);
+	} else
+		evtimer_del(&window_history_timer);
+
+	if (options_get_number(global_options, "history-memory-limit") != 0)
+		evtimer_add(&window_history_timer, &tv);
+}
+
+/*
+ * Find the next pane after the last one reflowed which has pending history and
+ * is not in a mode, going back to the start if necessary.
+ */
+static struct window_pane *
+window_reflow_next_pane(void)
+{
+	struct window_pane	*wp, find;
+
+	find.id = window_reflow_last + 1;
+	wp = RB_NFIND(window_pane_tree, &all_window_panes, &find);
+	while (wp != NULL) {
+		if (wp->mode == NULL && wp->base.grid->pending != NULL)
+			return (wp);
+		wp = RB_NEXT(window_pane_tree, &all_window_panes, wp);
+	}
+	RB_FOREACH(wp, window_pane_tree, &all_window_panes) {
+		if (wp->id > window_reflow_last)
+			break;
+		if (wp->mode == NULL && wp->base.grid->pending != NULL)
+			return (wp);
+	}
+	return (NULL);
+}
+
+/*
+ * Reflow pieces of pending history, taking each pane in turn, until there is
+ * none left or the time allowed for one go is used up. Then start the timer
+ * again so the event loop can run in between.
+ */
+static void
+window_reflow_timer_callback(__unused int fd, __unused short events,
+    __unused void *arg)
+{
+	struct window_pane	*wp;
+	struct timeval		 start, now, tv = { .tv_usec = 1000 };
+
+	gettimeofday(&start, NULL);
+	for (;;) {
+		if ((wp = window_reflow_next_pane()) == NULL)
+			return;
+		window_reflow_last = wp->id;
+		grid_reflow_pending(wp->base.grid);
+
+		gettimeofday(&now, NULL);
+		timersub(&now, &start, &now);
+		if (now.tv_sec != 0 || now.tv_usec >= WINDOW_REFLOW_TIME)
+			break;
+	}
+	evtimer_add(&window_reflow_timer, &tv);
+}
+
+/*
+ * Arrange for the pane history left by a reflow to be finished. A mode may be
+ * looking at the history so in that case it must be done now.
+ */
+static void
+window_pane_reflow(struct window_pane *wp)
+{
+	struct timeval	tv = { .tv_usec = 1000 };
+
+	if (wp->base.grid->pending == NULL)
+		return;
+	if (wp->mode != NULL) {
+		grid_reflow_finish(wp->base.grid);
+		return;
+	}
+
+	if (!event_initialized(&window_reflow_timer)) {
+		evtimer_set(&window_reflow_timer, window_reflow_timer_callback,
+		    NULL);
+	}
+	if (!evtimer_pending(&window_reflow_timer, NULL))
+		evtimer_add(&window_reflow_timer, &tv);
+}
+
 struct window *
 window_create(u_int sx, u_int sy)
 {
@@ -795,6 +1027,8 @@ window_pane_create(struct window *w, u_int sx, u_int sy, u_int hlimit)
 	wp->mode = NULL;
 	wp->modeprefix = 1;
 
+	gettimeofday(&wp->used_time, NULL);
+
 	wp->layout_cell = NULL;
 
 	wp->xoff = 0;
@@ -805,6 +1039,13 @@ window_pane_create(struct window *w, u_int sx, u_int sy, u_int hlimit)
 
 	wp->pipe_fd = -1;
 	wp->pipe_off = 0;
+
+	wp->read_size = READ_SIZE;
+	wp->read_average = 0;
+	evtimer_set(&wp->read_timer, window_pane_read_timer, wp);
+
+	wp->rate_used = 0;
+	evtimer_set(&wp->rate_timer, window_pane_rate_timer, wp);
 	wp->pipe_event = NULL;
 
 	wp->saved_grid = NULL;
@@ -851,6 +1092,8 @@ window_pane_destroy(struct window_pane *wp)
 
 	if (event_initialized(&wp->resize_timer))
 		event_del(&wp->resize_timer);
+	evtimer_del(&wp->read_timer);
+	evtimer_del(&wp->rate_timer);
 
 	RB_REMOVE(window_pane_tree, &all_window_panes, wp);
 
@@ -879,6 +1122,10 @@ window_pane_spawn(struct window_pane *wp, int argc, char **argv,
 		bufferevent_free(wp->event);
 		close(wp->fd);
 	}
+	evtimer_del(&wp->read_timer);
+	evtimer_del(&wp->rate_timer);
+	wp->rate_used = 0;
+	wp->flags &= ~PANE_RATELIMITED;
 	if (argc > 0) {
 		cmd_free_argv(wp->argc, wp->argv);
 		wp->argc = argc;
@@ -980,7 +1227,8 @@ window_pane_spawn(struct window_pane *wp, int argc, char **argv,
 	wp->event = bufferevent_new(wp->fd, window_pane_read_callback, NULL,
 	    window_pane_error_callback, wp);
 
-	bufferevent_setwatermark(wp->event, EV_READ, 0, READ_SIZE);
+	wp->read_size = READ_SIZE;
+	bufferevent_setwatermark(wp->event, EV_READ, 0, wp->read_size);
 	bufferevent_enable(wp->event, EV_READ|EV_WRITE);
 
 	free(cmd);
@@ -995,17 +1243,188 @@ window_pane_read_callback(__unused struct bufferevent *bufev, void *data)
 	size_t			 size = EVBUFFER_LENGTH(evb);
 	char			*new_data;
 	size_t			 new_size;
+	struct timeval		 tv = { .tv_usec = WINDOW_READ_TIME };
 
 	new_size = size - wp->pipe_off;
 	if (wp->pipe_fd != -1 && new_size > 0) {
 		new_data = EVBUFFER_DATA(evb) + wp->pipe_off;
 		bufferevent_write(wp->pipe_event, new_data, new_size);
 	}
+	wp->pipe_off = size;
+
+	/*
+	 * If the pane has been producing a lot of output, wait for the buffer
+	 * to fill up to the read size before parsing, or for the timer if
+	 * the output stops first. Parsing a large buffer at once is much
+	 * cheaper than the same data a few kilobytes at a time.
+	 */
+	if (wp->read_size > READ_SIZE && size < wp->read_size) {
+		if (!evtimer_pending(&wp->read_timer, NULL))
+			evtimer_add(&wp->read_timer, &tv);
+		return;
+	}
+	window_pane_read_parse(wp);
+}
+
+/* Read timer expired, so parse whatever has arrived. */
+static void
+window_pane_read_timer(__unused int fd, __unused short events, void *data)
+{
+	struct window_pane	*wp = data;
+
+	if (wp->fd != -1)
+		window_pane_read_parse(wp);
+}
+
+/*
+ * Parse pending output. Then grow the read size if the pane (nearly) filled
+ * it, up to the limit, or go back to the smallest size if the output was
+ * small, since the pane is probably now interactive.
+ */
+static void
+window_pane_read_parse(struct window_pane *wp)
+{
+	struct evbuffer	*evb = wp->event->input;
+	size_t		 size = EVBUFFER_LENGTH(evb), limit, old;
+
+	evtimer_del(&wp->read_timer);
+	if (size == 0)
+		return;
 
 	log_debug("%%%u has %zu bytes", wp->id, size);
 	input_parse(wp);
 
 	wp->pipe_off = EVBUFFER_LENGTH(evb);
+
+	limit = options_get_number(global_options, "read-size-limit");
+	old = wp->read_size;
+	if (size >= wp->read_size - wp->read_size / 4)
+		wp->read_size *= 2;
+	else if (size < wp->read_size / 4)
+		wp->read_size = READ_SIZE;
+	if (wp->read_size > limit)
+		wp->read_size = limit;
+	if (wp->read_size < READ_SIZE)
+		wp->read_size = READ_SIZE;
+	if (wp->read_size != old) {
+		log_debug("%%%u read size %zu", wp->id, wp->read_size);
+		bufferevent_setwatermark(wp->event, EV_READ, 0, wp->read_size);
+	}
+
+	wp->read_average = (wp->read_average * 7 + size) / 8;
+
+	window_pane_rate_limit(wp, size);
+}
+
+/*
+ * Get the share of the read rate limit for a pane: the active pane in a window
+ * that a client is looking at gets all of it, other visible panes half, and
+ * panes that nobody can see an eighth.
+ */
+static u_int
+window_pane_rate_share(struct window_pane *wp)
+{
+	struct client	*c;
+	int		 visible = 0;
+
+	if (window_pane_visible(wp)) {
+		TAILQ_FOREACH(c, &clients, entry) {
+			if (c->session == NULL ||
+			    (c->flags & (CLIENT_SUSPENDED|CLIENT_DEAD)))
+				continue;
+			if (c->session->flags & SESSION_UNATTACHED)
+				continue;
+			if (c->session->curw->window == wp->window) {
+				visible = 1;
+				break;
+			}
+		}
+	}
+	if (!visible)
+		return (8);
+	if (wp != wp->window->active)
+		return (2);
+	return (1);
+}
+
+/*
+ * Count bytes read against the read rate limit. If the pane has used its
+ * allowance for this period, stop reading from it until the period ends. The
+ * output stays in the pty, so the program writing it blocks.
+ */
+static void
+window_pane_rate_limit(struct window_pane *wp, size_t size)
+{
+	struct timeval	 now, tv;
+	size_t		 limit, allowed;
+	u_int		 periods;
+
+	limit = options_get_number(global_options, "read-rate-limit");
+	if (limit == 0) {
+		wp->rate_used = 0;
+		return;
+	}
+	allowed = limit / window_pane_rate_share(wp) / (1000000 /
+	    WINDOW_RATE_TIME);
+	if (allowed == 0)
+		allowed = 1;
+
+	/*
+	 * Take off the allowance for any periods that have finished, keeping
+	 * any excess so the rate works out right over time.
+	 */
+	gettimeofday(&now, NULL);
+	if (wp->rate_used == 0)
+		memcpy(&wp->rate_start, &now, sizeof wp->rate_start);
+	timersub(&now, &wp->rate_start, &tv);
+	periods = tv.tv_sec * (1000000 / WINDOW_RATE_TIME) +
+	    tv.tv_usec / WINDOW_RATE_TIME;
+	if (periods != 0) {
+		if (wp->rate_used > periods * allowed)
+			wp->rate_used -= periods * allowed;
+		else
+			wp->rate_used = 0;
+		tv.tv_sec = periods / (1000000 / WINDOW_RATE_TIME);
+		tv.tv_usec = (periods % (1000000 / WINDOW_RATE_TIME)) *
+		    WINDOW_RATE_TIME;
+		timeradd(&wp->rate_start, &tv, &wp->rate_start);
+	}
+
+	wp->rate_used += size;
+	if (wp->rate_used < allowed)
+		return;
+
+	/* Wait until enough periods have passed to pay for what was read. */
+	periods = wp->rate_used / allowed;
+	tv.tv_sec = periods / (1000000 / WINDOW_RATE_TIME);
+	tv.tv_usec = (periods % (1000000 / WINDOW_RATE_TIME)) *
+	    WINDOW_RATE_TIME;
+	timeradd(&wp->rate_start, &tv, &tv);
+	timersub(&tv, &now, &tv);
+
+	log_debug("%%%u read rate limited (%zu bytes)", wp->id, wp->rate_used);
+	wp->flags |= PANE_RATELIMITED;
+	bufferevent_disable(wp->event, EV_READ);
+	evtimer_add(&wp->rate_timer, &tv);
+}
+
+/*
+ * Read rate limit period ended, so start reading again unless copy mode has
+ * also stopped reading.
+ */
+static void
+window_pane_rate_timer(__unused int fd, __unused short events, void *data)
+{
+	struct window_pane	*wp = data;
+
+	if (wp->fd == -1)
+		return;
+	window_pane_rate_limit(wp, 0);
+	if (evtimer_pending(&wp->rate_timer, NULL))
+		return;
+	wp->flags &= ~PANE_RATELIMITED;
+	if (wp->mode != &window_copy_mode)
+		bufferevent_enable(wp->event, EV_READ);
 }
 
 static void
@@ -1014,6 +1433,7 @@ window_pane_error_callback(__unused struct bufferevent *bufev,
 {
 	struct window_pane *wp = data;
 
+	window_pane_read_parse(wp);
 	server_destroy_pane(wp, 1);
 }
 
@@ -1026,6 +1446,7 @@ window_pane_resize(struct window_pane *wp, u_int sx, u_int sy)
 	wp->sy = sy;
 
 	screen_resize(&wp->base, sx, sy, wp->saved_grid == NULL);
+	window_pane_reflow(wp);
 	if (wp->mode != NULL)
 		wp->mode->resize(wp, sx, sy);
 
@@ -1033,8 +1454,8 @@ window_pane_resize(struct window_pane *wp, u_int sx, u_int sy)
 }
 
 /*
- * Enter alternative screen mode. A copy of the visible screen is saved and the
- * history is not updated
+ * Enter alternative screen mode. The visible lines are moved to a saved grid
+ * sharing the pane grid's arena and the history is not updated.
  */
 void
 window_pane_alternate_on(struct window_pane *wp, struct grid_cell *gc,
@@ -1050,8 +1471,8 @@ window_pane_alternate_on(struct window_pane *wp, struct grid_cell *gc,
 	sx = screen_size_x(s);
 	sy = screen_size_y(s);
 
-	wp->saved_grid = grid_create(sx, sy, 0);
-	grid_duplicate_lines(wp->saved_grid, 0, s->grid, screen_hsize(s), sy);
+	wp->saved_grid = grid_create_shared(s->grid, sx, sy);
+	grid_take_lines(wp->saved_grid, 0, s->grid, screen_hsize(s), sy);
 	if (cursor) {
 		wp->saved_cx = s->cx;
 		wp->saved_cy = s->cy;
@@ -1065,7 +1486,7 @@ window_pane_alternate_on(struct window_pane *wp, struct grid_cell *gc,
 	wp->flags |= PANE_REDRAW;
 }
 
-/* Exit alternate screen mode and restore the copied grid. */
+/* Exit alternate screen mode and restore the saved grid. */
 void
 window_pane_alternate_off(struct window_pane *wp, struct grid_cell *gc,
     int cursor)
@@ -1088,7 +1509,7 @@ window_pane_alternate_off(struct window_pane *wp, struct grid_cell *gc,
 		screen_resize(s, sx, wp->saved_grid->sy, 1);
 
 	/* Restore the grid, cursor position and cell. */
-	grid_duplicate_lines(s->grid, screen_hsize(s), wp->saved_grid, 0, sy);
+	grid_take_lines(s->grid, screen_hsize(s), wp->saved_grid, 0, sy);
 	if (cursor)
 		s->cx = wp->saved_cx;
 	if (s->cx > screen_size_x(s) - 1)
@@ -1106,6 +1527,7 @@ window_pane_alternate_off(struct window_pane *wp, struct grid_cell *gc,
 	wp->base.grid->flags |= GRID_HISTORY;
 	if (sy > wp->saved_grid->sy || sx != wp->saved_grid->sx)
 		screen_resize(s, sx, sy, 1);
+	window_pane_reflow(wp);
 
 	grid_destroy(wp->saved_grid);
 	wp->saved_grid = NULL;
@@ -1221,6 +1643,9 @@ window_pane_reset_mode(struct window_pane *wp)
 	wp->mode = NULL;
 	wp->modeprefix = 1;
 
+	/* Pending history is not reflowed while in a mode, so start again. */
+	window_pane_reflow(wp);
+
 	wp->screen = &wp->base;
 	wp->flags |= (PANE_REDRAW|PANE_CHANGED);
 